@@ -14,10 +14,25 @@
 #include <linux/string.h>
 #include <linux/bitrev.h>
 #include <linux/gpio.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/firmware.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/delay.h>
+#include <linux/completion.h>
 
 #include "avl6381.h"
 #include "avl6381_priv.h"
 
+#define CREATE_TRACE_POINTS
+#include "avl6381_trace.h"
+#ifdef AVL6381_BUILTIN_PATCH
+#include "avl6381_freezeData_DTMB.h"
+#endif
+
 enum avl6381_mode {
 	MODE_DTMB,
 	MODE_DVBC
@@ -52,6 +67,48 @@ MODULE_PARM_DESC(debug_avl, "\n\t\t Enable AVL demodulator debug information");
 static int debug_avl;
 module_param(debug_avl, int, 0644);
 
+static bool fast_switch = true;
+module_param(fast_switch, bool, 0644);
+MODULE_PARM_DESC(fast_switch, "skip PLL and SDRAM setup a mode switch does not change");
+
+static unsigned int wait_min_us = 100;
+module_param(wait_min_us, uint, 0644);
+MODULE_PARM_DESC(wait_min_us, "first poll interval of firmware waits (us)");
+
+static unsigned int nosig_window_ms = 60;
+module_param(nosig_window_ms, uint, 0644);
+MODULE_PARM_DESC(nosig_window_ms, "time after tuning to look for an empty channel (ms)");
+
+static int nosig_rf_dbm = -90;
+module_param(nosig_rf_dbm, int, 0644);
+MODULE_PARM_DESC(nosig_rf_dbm, "RF input below which the tuner counts as seeing no signal (dBm)");
+
+static unsigned int nosig_votes = 3;
+module_param(nosig_votes, uint, 0644);
+MODULE_PARM_DESC(nosig_votes, "no-signal indicators (tuner AGC, RF power, demod) that must agree");
+
+static bool fixed_params = true;
+module_param(fixed_params, bool, 0644);
+MODULE_PARM_DESC(fixed_params, "lock with the parameters userspace gave instead of searching for them");
+
+static bool watchdog = true;
+module_param(watchdog, bool, 0644);
+MODULE_PARM_DESC(watchdog, "reacquire lost lock without waiting for a new tune");
+
+static unsigned int wd_retune_ms = 2000;
+module_param(wd_retune_ms, uint, 0644);
+MODULE_PARM_DESC(wd_retune_ms, "interval of full retunes while the lock stays lost (ms)");
+
+static unsigned int stats_fast_ms = 20;
+module_param(stats_fast_ms, uint, 0644);
+MODULE_PARM_DESC(stats_fast_ms, "status sampling period while acquiring (ms)");
+
+static unsigned int stats_slow_ms = 1000;
+module_param(stats_slow_ms, uint, 0644);
+MODULE_PARM_DESC(stats_slow_ms, "status sampling period once the lock state is steady (ms)");
+
+static void avl6381_batch_sync(struct avl6381_priv *priv);
+
 static int avl6381_i2c_rd(struct avl6381_priv *priv, u8 *buf, int len)
 {
 	int ret;
@@ -61,6 +118,8 @@ static int avl6381_i2c_rd(struct avl6381_priv *priv, u8 *buf, int len)
 			.len  = len,
 			.buf  = buf,
 	};
+	avl6381_batch_sync(priv);
+	priv->i2c_xfers++;
 	ret = i2c_transfer(priv->i2c, &msg, 1);
 	if (ret == 1) {
 		ret = 0;
@@ -82,6 +141,8 @@ static int avl6381_i2c_wr(struct avl6381_priv *priv, u8 *buf, int len)
 		.buf = buf,
 		.len = len,
 	};
+	avl6381_batch_sync(priv);
+	priv->i2c_xfers++;
 	ret = i2c_transfer(priv->i2c, &msg, 1);
 	if (ret == 1) {
 		ret = 0;
@@ -104,6 +165,8 @@ static int avl6381_i2c_wrm(struct avl6381_priv *priv, u8 *buf, int len)
 		.buf = buf,
 		.len = len,
 	};
+	avl6381_batch_sync(priv);
+	priv->i2c_xfers++;
 	ret = i2c_transfer(priv->i2c, &msg, 1);
 	if (ret == 1) {
 		ret = 0;
@@ -116,6 +179,212 @@ static int avl6381_i2c_wrm(struct avl6381_priv *priv, u8 *buf, int len)
 }
 
 
+/*
+ * Registers the firmware or the hardware change behind our back, or whose
+ * writes act as commands. They always go to the bus; everything else is
+ * shadowed in priv->regcache.
+ */
+static const struct {
+	u32 lo, hi;
+} avl6381_volatile_regs[] = {
+	{ 0x0000a0, 0x0000ad },	/* chip ready, halt, PER, DTMB lock/acquire */
+	{ 0x00010c, 0x00014f },	/* DTMB acquire, SNR, running level, no signal */
+	{ 0x0001a0, 0x0001bb },	/* DVB-C halt, PER, lock, SNR, no signal */
+	{ 0x000200, 0x000207 },	/* current mode, RX op command */
+	{ 0x00021f, 0x00021f },	/* DTMB auto lock */
+	{ 0x0005d8, 0x0005db },	/* DVB-C SNR trigger */
+	{ 0x040000, 0x040003 },	/* family id */
+	{ 0x100000, 0x1000ff },	/* PLL, strobed */
+	{ 0x108004, 0x108007 },	/* chip id */
+	{ 0x110084, 0x110087 },	/* cpu reset */
+	{ 0x110840, 0x110843 },	/* chip ready */
+	{ 0x149110, 0x149117 },	/* BER counters */
+	{ 0x149128, 0x14912b },	/* error statistics reset */
+	{ 0x38fffc, 0x38ffff },	/* digital core reset */
+};
+
+static int avl6381_reg_volatile(u32 addr, int size)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(avl6381_volatile_regs); i++)
+		if (addr + size > avl6381_volatile_regs[i].lo &&
+				addr <= avl6381_volatile_regs[i].hi)
+			return 1;
+	return 0;
+}
+
+static int avl6381_regcache_lookup(struct avl6381_priv *priv,
+	u32 addr, int size, u32 *val)
+{
+	struct avl6381_regcache_entry *e;
+	int i;
+
+	for (i = 0; i < AVL6381_REGCACHE_SIZE; i++) {
+		e = &priv->regcache[i];
+		if (e->size == size && e->addr == addr) {
+			*val = e->val;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void avl6381_regcache_store(struct avl6381_priv *priv,
+	u32 addr, int size, u32 val)
+{
+	struct avl6381_regcache_entry *e, *slot = NULL;
+	int i;
+
+	for (i = 0; i < AVL6381_REGCACHE_SIZE; i++) {
+		e = &priv->regcache[i];
+		if (!e->size) {
+			if (!slot)
+				slot = e;
+		} else if (e->size == size && e->addr == addr) {
+			slot = e;
+		} else if (addr < e->addr + e->size && e->addr < addr + size) {
+			/* overlapping access of another width */
+			e->size = 0;
+			if (!slot)
+				slot = e;
+		}
+	}
+
+	/* table full, stay write-through for this register */
+	if (!slot)
+		return;
+
+	slot->addr = addr;
+	slot->size = size;
+	slot->val = val;
+}
+
+/* forget registers in [lo, hi), e.g. after the firmware reloaded them */
+static void avl6381_regcache_invalidate(struct avl6381_priv *priv,
+	u32 lo, u32 hi)
+{
+	struct avl6381_regcache_entry *e;
+	int i;
+
+	for (i = 0; i < AVL6381_REGCACHE_SIZE; i++) {
+		e = &priv->regcache[i];
+		if (e->size && e->addr >= lo && e->addr < hi)
+			e->size = 0;
+	}
+}
+
+#define AVL6381_REGCACHE_ALL	0, 0xffffffff
+/* parameter RAM reloaded by the firmware on boot and on load-defaults */
+#define AVL6381_REGCACHE_FW	0, 0x100000
+
+/*
+ * Write batching. Register writes issued between avl6381_batch_begin() and
+ * avl6381_batch_end() are queued instead of sent; a write that continues
+ * the previous one is appended to it as a burst (same layout as
+ * avl6381_i2c_wr_data), and the queue goes out as a single multi-message
+ * i2c_transfer. Any direct read or write flushes the queue first so the
+ * bus order is unchanged, callers only have to flush before sleeping.
+ */
+static int avl6381_batch_xfer(struct avl6381_priv *priv)
+{
+	struct avl6381_batch *b = &priv->batch;
+	int i, ret, num = b->nmsgs;
+
+	if (!num)
+		return 0;
+
+	/* empty the queue first, the fallback below goes through i2c_wr */
+	b->nmsgs = 0;
+	b->len = 0;
+
+	if (!priv->no_multi_msg) {
+		priv->i2c_xfers++;
+		ret = i2c_transfer(priv->i2c, b->msgs, num);
+		if (ret == num)
+			return 0;
+		if (ret != -EOPNOTSUPP) {
+			dev_warn(&priv->i2c->dev, "%s: i2c batch failed=%d " \
+					"num=%d\n", KBUILD_MODNAME, ret, num);
+			ret = -EREMOTEIO;
+			goto err;
+		}
+		dbg_avl("adapter rejects multi-message transfers");
+		priv->no_multi_msg = 1;
+	}
+
+	for (i = 0, ret = 0; i < num && !ret; i++)
+		ret = avl6381_i2c_wr(priv, b->msgs[i].buf, b->msgs[i].len);
+	if (!ret)
+		return 0;
+err:
+	/* the shadow already holds the values that did not make it */
+	avl6381_regcache_invalidate(priv, AVL6381_REGCACHE_ALL);
+	if (!b->ret)
+		b->ret = ret;
+	return ret;
+}
+
+static void avl6381_batch_sync(struct avl6381_priv *priv)
+{
+	if (priv->batch.nmsgs)
+		avl6381_batch_xfer(priv);
+}
+
+static int avl6381_batch_wr(struct avl6381_priv *priv, u32 addr,
+	const u8 *data, int len)
+{
+	struct avl6381_batch *b = &priv->batch;
+	struct i2c_msg *msg;
+	u8 *p;
+
+	if (b->nmsgs) {
+		msg = &b->msgs[b->nmsgs - 1];
+		if (addr == b->next_addr &&
+				msg->len + len <= MAX_II2C_WRITE_SIZE) {
+			memcpy(&b->buf[b->len], data, len);
+			msg->len += len;
+			b->len += len;
+			b->next_addr += len;
+			return 0;
+		}
+	}
+
+	if (b->nmsgs == AVL6381_BATCH_MAX_MSGS)
+		avl6381_batch_xfer(priv);
+
+	p = &b->buf[b->len];
+	*(p++) = (u8) (addr >> 16);
+	*(p++) = (u8) (addr >> 8);
+	*(p++) = (u8) (addr);
+	memcpy(p, data, len);
+
+	msg = &b->msgs[b->nmsgs++];
+	msg->addr = priv->config->demod_address;
+	msg->flags = 0;
+	msg->buf = &b->buf[b->len];
+	msg->len = 3 + len;
+
+	b->len += 3 + len;
+	b->next_addr = addr + len;
+	return 0;
+}
+
+static void avl6381_batch_begin(struct avl6381_priv *priv)
+{
+	if (!priv->batch.depth++)
+		priv->batch.ret = 0;
+}
+
+static int avl6381_batch_end(struct avl6381_priv *priv)
+{
+	if (--priv->batch.depth)
+		return 0;
+
+	avl6381_batch_xfer(priv);
+	return priv->batch.ret;
+}
+
 /* write 32bit words at addr */
 #define MAX_WORDS_WR_LEN	((MAX_II2C_WRITE_SIZE-3) / 4)
 static int avl6381_i2c_wr_data(struct avl6381_priv *priv,
@@ -158,6 +427,18 @@ static int avl6381_i2c_wr_reg(struct avl6381_priv *priv,
 {
 	u8 buf[3 + 4];
 	u8 *p = buf;
+	int ret, cacheable;
+	u32 cached;
+
+	if (reg_size < 4)
+		data &= (1U << (reg_size * 8)) - 1;
+
+	cacheable = !avl6381_reg_volatile(addr, reg_size);
+	if (cacheable && avl6381_regcache_lookup(priv, addr, reg_size, &cached) &&
+			cached == data) {
+		priv->reg_wr_skips++;
+		return 0;
+	}
 
 	*(p++) = (u8) (addr >> 16);
 	*(p++) = (u8) (addr >> 8);
@@ -175,7 +456,18 @@ static int avl6381_i2c_wr_reg(struct avl6381_priv *priv,
 		break;
 	}
 
-	return avl6381_i2c_wr(priv, buf, 3 + reg_size);
+	if (priv->batch.depth)
+		ret = avl6381_batch_wr(priv, addr, &buf[3], reg_size);
+	else
+		ret = avl6381_i2c_wr(priv, buf, 3 + reg_size);
+
+	if (!cacheable)
+		return ret;
+	if (ret)
+		avl6381_regcache_invalidate(priv, addr, addr + reg_size);
+	else
+		avl6381_regcache_store(priv, addr, reg_size, data);
+	return ret;
 }
 
 #define AVL6381_WR_REG8(_priv, _addr, _data) \
@@ -189,10 +481,16 @@ static int avl6381_i2c_wr_reg(struct avl6381_priv *priv,
 static int avl6381_i2c_rd_reg(struct avl6381_priv *priv,
 	u32 addr, u32 *data, int reg_size)
 {
-	int ret;
+	int ret, cacheable;
 	u8 buf[3 + 4];
 	u8 *p = buf;
 
+	cacheable = !avl6381_reg_volatile(addr, reg_size);
+	if (cacheable && avl6381_regcache_lookup(priv, addr, reg_size, data)) {
+		priv->reg_rd_hits++;
+		return 0;
+	}
+
 	*(p++) = (u8) (addr >> 16);
 	*(p++) = (u8) (addr >> 8);
 	*(p++) = (u8) (addr);
@@ -213,6 +511,9 @@ static int avl6381_i2c_rd_reg(struct avl6381_priv *priv,
 		*data |= (u32) *(p);
 		break;
 	}
+
+	if (cacheable && !ret)
+		avl6381_regcache_store(priv, addr, reg_size, *data);
 	return ret;
 }
 
@@ -223,6 +524,21 @@ static int avl6381_i2c_rd_reg(struct avl6381_priv *priv,
 #define AVL6381_RD_REG32(_priv, _addr, _data) \
 	avl6381_i2c_rd_reg(_priv, _addr, _data, 4)
 
+/* read chip memory straight from the device, never from the shadow */
+static int avl6381_i2c_rd_mem(struct avl6381_priv *priv,
+	u32 addr, u8 *data, int len)
+{
+	int ret;
+	u8 buf[3];
+
+	buf[0] = (u8) (addr >> 16);
+	buf[1] = (u8) (addr >> 8);
+	buf[2] = (u8) (addr);
+	ret = avl6381_i2c_wr(priv, buf, 3);
+	ret |= avl6381_i2c_rd(priv, data, len);
+	return ret;
+}
+
 
 static int GetRxOP_Status_6381(struct avl6381_priv *priv)
 {
@@ -240,22 +556,50 @@ static int GetRxOP_Status_6381(struct avl6381_priv *priv)
   return ret;
 }
 
+#define AVL6381_WAIT_MAX_US	20000
+
+/*
+ * Poll @busy until it returns 0 or @timeout_ms passes. Sleeps start at
+ * wait_min_us and double up to AVL6381_WAIT_MAX_US. Bus errors count as
+ * busy, the chip does not always answer while it restarts. Returns 0 or
+ * 16 on timeout, like the old fixed count loops.
+ */
+static int avl6381_wait(struct avl6381_priv *priv, enum avl6381_wait_op op,
+	int (*busy)(struct avl6381_priv *priv), unsigned int timeout_ms)
+{
+	struct avl6381_wait_stats *ws = &priv->waits[op];
+	ktime_t start = ktime_get();
+	ktime_t deadline = ktime_add_ms(start, timeout_ms);
+	unsigned int us = max(wait_min_us, 1U);
+	s64 left, elapsed;
+
+	while (busy(priv)) {
+		left = ktime_us_delta(deadline, ktime_get());
+		if (left <= 0) {
+			ws->timeouts++;
+			return 16;
+		}
+		us = min_t(s64, us, left);
+		usleep_range(us, us + us / 4);
+		us = min(us * 2, AVL6381_WAIT_MAX_US);
+	}
+
+	elapsed = ktime_us_delta(ktime_get(), start);
+	ws->hist[min(fls64(elapsed), AVL6381_WAIT_BUCKETS - 1)]++;
+	return 0;
+}
+
 static int SendRxOP_6381(struct avl6381_priv *priv, int a2)
 {
   int ret;
-  signed int v7;
 
-  v7 = 42;
-  while ( ret = GetRxOP_Status_6381(priv) )
-  {
-    if ( !--v7 )
-    {
-      ret = 16;
-      goto LABEL_11;
-    }
-    msleep(10);
-  }
+  ret = avl6381_wait(priv, AVL6381_WAIT_RXOP, GetRxOP_Status_6381, 420);
+  if ( ret )
+    goto LABEL_11;
   ret |= AVL6381_WR_REG32(priv, 0x000204, (unsigned int)(a2 << 24));		//pj 0x000204 w 0x01000000	win5850
+  /* load defaults (1) and mode change (10) rewrite the parameter RAM */
+  if (a2 == 1 || a2 == 10)
+    avl6381_regcache_invalidate(priv, AVL6381_REGCACHE_FW);
 
 LABEL_11:
   return ret;
@@ -266,7 +610,8 @@ static int DigitalCoreReset_6381(struct avl6381_priv *priv)
   int ret;
 
   ret = AVL6381_WR_REG32(priv, 0x38FFFC, 0);
-  msleep(10);
+  avl6381_batch_sync(priv);
+  usleep_range(10000, 11000);
   return ret | AVL6381_WR_REG32(priv, 0x38FFFC, 1);
 }
 
@@ -319,7 +664,7 @@ static int DTMB_SetSpectrumPola_6381(struct avl6381_priv *priv, unsigned int a2)
 
 	if ( a2 == 1 )
 	{
-		ret |= AVL6381_WR_REG8(priv, 0x000322, 0x00);					//win5890
+		ret = AVL6381_WR_REG8(priv, 0x000322, 0x00);					//win5890
 		ret |= AVL6381_WR_REG32(priv, 0x000324, 0x004C4B40); //check ??	//win5894
 	}
 	else
@@ -329,7 +674,7 @@ static int DTMB_SetSpectrumPola_6381(struct avl6381_priv *priv, unsigned int a2)
 		else
 			data = 0x02;
 
-		ret |= AVL6381_WR_REG8(priv, 0x000322, data);					//win5890
+		ret = AVL6381_WR_REG8(priv, 0x000322, data);					//win5890
 		ret |= AVL6381_WR_REG32(priv, 0x000324, 0xFFB3B4C0);	//win5894
 	}
 	
@@ -340,6 +685,13 @@ static int SetPLL_6381(struct avl6381_priv *priv, u8 *pll_conf)
 {
 	int ret;
 	
+	if (fast_switch && priv->pll_conf &&
+			!memcmp(priv->pll_conf, pll_conf, sizeof(AVL6381PLLConfig[0]))) {
+		dbg_avl("PLL already set up");
+		return 0;
+	}
+
+	avl6381_batch_begin(priv);
 	ret = AVL6381_WR_REG32(priv, 0x1000C0, pll_conf[4] - 1);//0x01);			//win634
 	ret |= AVL6381_WR_REG32(priv, 0x1000C4, pll_conf[5] - 1);//0x4A);
 	ret |= AVL6381_WR_REG32(priv, 0x1000D4, pll_conf[6]);//0x03);
@@ -353,61 +705,237 @@ static int SetPLL_6381(struct avl6381_priv *priv, u8 *pll_conf)
 	ret |= AVL6381_WR_REG32(priv, 0x100090, pll_conf[17] - 1);//0x1B);
 	ret |= AVL6381_WR_REG32(priv, 0x100000, 0x00);
 	ret |= AVL6381_WR_REG32(priv, 0x100000, 0x01);
-	msleep(5);
+	avl6381_batch_sync(priv);
+	usleep_range(5000, 6000);
 	ret |= AVL6381_WR_REG32(priv, 0x100018, pll_conf[5*4] | pll_conf[5*4+1]<<8 | pll_conf[5*4+2]<<16 | pll_conf[5*4+3]<<32);//0x6E);
 	ret |= AVL6381_WR_REG32(priv, 0x10001C, pll_conf[6*4] | pll_conf[6*4+1]<<8 | pll_conf[6*4+2]<<16 | pll_conf[6*4+3]<<32);//0x0F);
 	ret |= AVL6381_WR_REG32(priv, 0x100010, 0x01);
 	ret |= AVL6381_WR_REG32(priv, 0x100008, 0x01);
 	ret |= AVL6381_WR_REG32(priv, 0x100008, 0x00);		//win698
+	ret |= avl6381_batch_end(priv);
+	priv->pll_conf = ret ? NULL : pll_conf;
 	
 	return ret;
 }
 
-static int avl6381_wr_firmware(struct avl6381_priv *priv, u8 *data, int len)
+/*
+ * Patch payload bytes per i2c write. Use the largest message the adapter
+ * advertises, minus the 3 address bytes; adapters that do not say are
+ * fed the conservative size the driver always used.
+ */
+#define AVL6381_PATCH_CHUNK_DEF	47
+#define AVL6381_PATCH_CHUNK_MAX	(255 - 3)
+
+static int avl6381_patch_chunk(struct avl6381_priv *priv)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	const struct i2c_adapter_quirks *q = priv->i2c->quirks;
+
+	if (q && q->max_write_len > 3)
+		return min_t(int, q->max_write_len - 3, AVL6381_PATCH_CHUNK_MAX);
+#endif
+	return AVL6381_PATCH_CHUNK_DEF;
+}
+
+static int avl6381_wr_firmware(struct avl6381_priv *priv, u8 *buf, int chunk,
+			       const struct avl6381_patch_seg *seg)
 {
 	int ret;
-	u8 buf[50];
 	int size, pos;
 	u32 addr;
 	
 	ret = 0;
-	pos = 3;
-	addr = (data[0]<<16) + (data[1]<<8) + data[2];
-	while (pos < len)
+	pos = 0;
+	addr = seg->addr;
+	while (pos < seg->len)
 	{
-		if ((len - pos) >= 47)
-			size = 50;
-		else
-			size = len - pos + 3;
+		size = min_t(int, seg->len - pos, chunk);
 		buf[0] = (addr>>16) & 0xFF;
 		buf[1] = (addr>>8) & 0xFF;
 		buf[2] = addr & 0xFF;
-		memcpy(buf + 3, data + pos, size - 3);
-		ret |= avl6381_i2c_wr(priv, buf, size);
+		memcpy(buf + 3, seg->data + pos, size);
+		ret |= avl6381_i2c_wr(priv, buf, size + 3);
 		if (ret)
 			break;
-		pos += 47;
-		addr += 47;
+		pos += size;
+		addr += size;
+	}
+	priv->patch_bytes += pos;
+	return ret;
+}
+
+/*
+ * Patch image: 4 byte header, then segments of
+ *   be32 length, 1 unused byte, be24 address, <length> bytes of data
+ * terminated by a zero length.
+ */
+static u32 avl6381_be32(const u8 *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static struct avl6381_patch *avl6381_patch_parse(const u8 *data, size_t size)
+{
+	struct avl6381_patch *patch;
+	size_t i;
+	u32 len;
+	int n = 0;
+
+	/* count the segments and check they stay inside the image */
+	for (i = 4; i + 8 <= size; i += len + 8) {
+		len = avl6381_be32(&data[i]);
+		if (!len)
+			break;
+		if (len > size - i - 8)
+			return NULL;
+		n++;
+	}
+	if (!n || i + 8 > size)
+		return NULL;
+
+	patch = kzalloc(sizeof(*patch) + n * sizeof(patch->seg[0]), GFP_KERNEL);
+	if (!patch)
+		return NULL;
+
+	kref_init(&patch->kref);
+	patch->nsegs = n;
+	for (i = 4, n = 0; n < patch->nsegs; i += len + 8, n++) {
+		len = avl6381_be32(&data[i]);
+		patch->seg[n].addr = (data[i + 5] << 16) | (data[i + 6] << 8) |
+				     data[i + 7];
+		patch->seg[n].len = len;
+		patch->seg[n].data = &data[i + 8];
+	}
+	return patch;
+}
+
+/* remember a few bytes of every segment, so later checks need no patch */
+static void avl6381_patch_fingerprint(struct avl6381_priv *priv)
+{
+	const struct avl6381_patch_seg *seg;
+	struct avl6381_patch_fp *fp;
+	int i;
+
+	for (i = 0; i < priv->patch->nsegs && i < AVL6381_PATCH_FP_MAX; i++) {
+		seg = &priv->patch->seg[i];
+		fp = &priv->patch_fp[i];
+		fp->addr = seg->addr;
+		fp->len = min_t(int, seg->len, AVL6381_PATCH_FP_LEN);
+		memcpy(fp->data, seg->data, fp->len);
+	}
+	priv->patch_fp_n = i;
+}
+
+static DEFINE_MUTEX(avl6381_patch_lock);
+static struct avl6381_patch *avl6381_patch_shared;
+
+static void avl6381_patch_free(struct kref *kref)
+{
+	struct avl6381_patch *patch =
+		container_of(kref, struct avl6381_patch, kref);
+
+	avl6381_patch_shared = NULL;
+	release_firmware(patch->fw);
+	kfree(patch);
+}
+
+/* take a reference on the shared patch, loading it on first use */
+static int avl6381_patch_get(struct avl6381_priv *priv)
+{
+	const struct firmware *fw = NULL;
+	struct avl6381_patch *patch;
+	int ret = 0;
+
+	if (priv->patch)
+		return 0;
+
+	mutex_lock(&avl6381_patch_lock);
+	patch = avl6381_patch_shared;
+	if (patch) {
+		kref_get(&patch->kref);
+		goto out;
+	}
+
+	ret = request_firmware(&fw, AVL6381_PATCH_FW, &priv->i2c->dev);
+	if (!ret) {
+		patch = avl6381_patch_parse(fw->data, fw->size);
+		if (patch) {
+			patch->fw = fw;
+		} else {
+			dev_err(&priv->i2c->dev, "%s: %s is corrupt",
+					KBUILD_MODNAME, AVL6381_PATCH_FW);
+			release_firmware(fw);
+			ret = -EINVAL;
+		}
+	}
+#ifdef AVL6381_BUILTIN_PATCH
+	if (!patch) {
+		dev_info(&priv->i2c->dev, "%s: using built-in patch",
+				KBUILD_MODNAME);
+		patch = avl6381_patch_parse(AVL6381_freezeData_DTMB,
+				sizeof(AVL6381_freezeData_DTMB));
+		ret = patch ? 0 : -ENOMEM;
+	}
+#endif
+	if (!patch) {
+		dev_err(&priv->i2c->dev, "%s: no patch available (%d)",
+				KBUILD_MODNAME, ret);
+		goto unlock;
 	}
+	avl6381_patch_shared = patch;
+out:
+	priv->patch = patch;
+	avl6381_patch_fingerprint(priv);
+unlock:
+	mutex_unlock(&avl6381_patch_lock);
 	return ret;
 }
 
+static void avl6381_patch_put(struct avl6381_priv *priv)
+{
+	if (!priv->patch)
+		return;
+
+	mutex_lock(&avl6381_patch_lock);
+	kref_put(&priv->patch->kref, avl6381_patch_free);
+	mutex_unlock(&avl6381_patch_lock);
+	priv->patch = NULL;
+}
+
 static int avl6381_patch_new(struct avl6381_priv *priv)
 {
-  int i;
-  int ret=0;
-	u8 *v8;
-	int v11;
-	
-	v8 = AVL6381_freezeData_DTMB;
-  for ( i = 4; ; i += v11 + 8 )
-  {
-    v11 = (((((v8[i] << 8) + v8[i + 1]) << 8) + v8[i + 2]) << 8) + v8[i + 3];
-    if ( !v11 | (i>sizeof(AVL6381_freezeData_DTMB)))
-      break;
-    ret |= avl6381_wr_firmware(priv, &v8[i + 5], v11 + 3);
-  }
+	int i;
+	int ret = 0;
+	u8 *buf;
+	int chunk = avl6381_patch_chunk(priv);
+	u32 xfers;
+	ktime_t start;
+
+	ret = avl6381_patch_get(priv);
+	if (ret)
+		return ret;
+
+	xfers = priv->i2c_xfers;
+	start = ktime_get();
+
+	buf = kmalloc(chunk + 3, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	priv->patch_bytes = 0;
+	for (i = 0; i < priv->patch->nsegs && !ret; i++)
+		ret |= avl6381_wr_firmware(priv, buf, chunk, &priv->patch->seg[i]);
+	kfree(buf);
+	if (ret)
+		return ret;
+
+	priv->patch_xfers = priv->i2c_xfers - xfers;
+	priv->patch_us = ktime_us_delta(ktime_get(), start);
+	dev_info(&priv->i2c->dev, "%s: patch upload %u bytes in %lld us, %u i2c transactions of up to %d bytes\n",
+		KBUILD_MODNAME, priv->patch_bytes, priv->patch_us,
+		priv->patch_xfers, chunk);
  
+	avl6381_batch_begin(priv);
 	ret |= AVL6381_WR_REG32(priv, 0x000228, 0x00280000);				//win5772
 	ret |= AVL6381_WR_REG32(priv, 0x00022C, 0x002D0008);				//win5726
 	ret |= AVL6381_WR_REG32(priv, 0x000230, 0x0028CB00);				//win5730
@@ -418,10 +946,45 @@ static int avl6381_patch_new(struct avl6381_priv *priv)
 	ret |= AVL6381_WR_REG16(priv, 0x2D0002, 0x0000);						//win5750
 	ret |= AVL6381_WR_REG32(priv, 0x0000A0, 0x00000000);				//win5754
 	ret |= AVL6381_WR_REG32(priv, 0x110840, 0x00000000);				//win5758
+	ret |= avl6381_batch_end(priv);
 
 	return ret;
 }
 
+/* entry vectors avl6381_patch_new points at the patch */
+static const u32 avl6381_patch_vectors[] = {
+	0x00280000, 0x002D0008, 0x0028CB00, 0x002F2C08,
+};
+
+/*
+ * Is our patch loaded and running? The chip must report ready, the entry
+ * vectors at 0x000228 must point into the patch and every fingerprinted
+ * segment must read back unchanged. Reads bypass the register shadow.
+ */
+static int avl6381_patch_running(struct avl6381_priv *priv)
+{
+	struct avl6381_patch_fp *fp;
+	u8 buf[4 * ARRAY_SIZE(avl6381_patch_vectors)];
+	int i;
+
+	if (!priv->patch_fp_n || CheckChipReady_6381(priv))
+		return 0;
+
+	if (avl6381_i2c_rd_mem(priv, 0x000228, buf, sizeof(buf)))
+		return 0;
+	for (i = 0; i < ARRAY_SIZE(avl6381_patch_vectors); i++)
+		if (avl6381_be32(&buf[4 * i]) != avl6381_patch_vectors[i])
+			return 0;
+
+	for (i = 0; i < priv->patch_fp_n; i++) {
+		fp = &priv->patch_fp[i];
+		if (avl6381_i2c_rd_mem(priv, fp->addr, buf, fp->len) ||
+				memcmp(buf, fp->data, fp->len))
+			return 0;
+	}
+	return 1;
+}
+
 //static int avl6381_patch(struct avl6381_priv *priv, u8 patch_data[][], int data_size)
 /*static int avl6381_patch(struct avl6381_priv *priv)
 {
@@ -462,76 +1025,94 @@ static int IBase_Initialize_6381(struct avl6381_priv *priv, u8 *pll_conf)
 {
 	int ret;
 
+	/* PLL, core reset and patch: nothing in the shadow survives */
+	avl6381_regcache_invalidate(priv, AVL6381_REGCACHE_ALL);
+	priv->pll_conf = NULL;
+	priv->sdram_inited = 0;
+
+	avl6381_batch_begin(priv);
 	ret = AVL6381_WR_REG32(priv, 0x110840, 0x00000001);				//win5758
 	ret |= SetPLL_6381(priv, pll_conf);
   ret |= DigitalCoreReset_6381(priv);
+	ret |= avl6381_batch_end(priv);
   if (!ret)
 		ret |= avl6381_patch_new(priv);
 	
   return ret;
 }
 
-static int DVBC_InitRx_6381(struct avl6381_priv *priv)
-{
-	int ret;
-	
-  ret = SendRxOP_6381(priv, 1);
-  if ( !ret )
-  {
-		ret |= AVL6381_WR_REG32(priv, 0x000560, 0x0d59f800);	//win5854
-		ret |= AVL6381_WR_REG32(priv, 0x0005a8, 0x0a037a00);	//win5858
-		ret |= AVL6381_WR_REG32(priv, 0x00055c, 0x016e3600);	//win5862
-		ret |= AVL6381_WR_REG32(priv, 0x000580, 0x004c4b40);	//win5866
-		ret |= AVL6381_WR_REG32(priv, 0x000558, 0x0068e778);	//win5866
-  }
-  return ret;
-}
-
-static int DVBC_InitADC_6381(struct avl6381_priv *priv)
-{
-  int ret;
-
-	ret = AVL6381_WR_REG8(priv, 0x00057d, 0x01);					//win5870
-	ret |= AVL6381_WR_REG8(priv, 0x00057f, 0x01);					//win5874
-	ret |= AVL6381_WR_REG8(priv, 0x00057c, 0x00);					//win5878
-	ret |= AVL6381_WR_REG8(priv, 0x000747, 0x00);					//win5882
+/*
+ * Per-mode parameter RAM profiles, replayed after the load-defaults op.
+ * Sorted by address so neighbouring registers go out in one i2c message.
+ */
+static const struct avl6381_reg avl6381_dtmb_rx[] = {
+	{ 0x0000A6, 1, 0x00 },						//win5886
+	{ 0x000304, 4, 0x016E3600 },				//win5866
+	{ 0x000319, 1, 0x00 },						//win5878
+	{ 0x000320, 1, 0x00 },	/* ADC */				//check
+	{ 0x000321, 1, 0x01 },						//win5870
+	{ 0x000323, 1, 0x01 },						//win5874
+	{ 0x00032B, 1, 0x01 },						//win5882
+	{ 0x000338, 4, 0x11E1A300 },				//win5854
+	{ 0x00033C, 4, 0x04C4B400 },				//win5862
+	{ 0x000384, 4, 0x0A037A00 },				//win5858
+	{ 0x0004d7, 1, 0x00 },	/* ADC */				//check
+};
 
-  return ret;
-}
+static const struct avl6381_reg avl6381_dtmb_out[] = {
+	{ 0x000300, 4, 7560000 },	/* symbol rate */		//win5942
+	{ 0x00030B, 1, 0 },		/* AGC polarity */		//win6018
+	{ 0x000350, 1, 0 },		/* serial order */		//win5958
+	{ 0x000351, 1, 0 },		/* serial pin */		//win5954
+	{ 0x000352, 1, 1 },		/* mpeg mode */			//win5946
+	{ 0x000353, 1, 1 },						//win5950
+	{ 0x000354, 1, 0 },		/* error polarity */		//win5970
+	{ 0x000357, 1, 0 },		/* packet length */		//win5978
+	{ 0x000378, 1, 1 },		/* error bit */			//win5966
+	{ 0x00038B, 1, 0 },		/* no continuous mode */	//win5982
+	{ 0x0004E6, 1, 0 },		/* serial sync pulse */		//win5962
+	{ 0x0004E7, 1, 0 },		/* valid polarity */		//win5974
+	{ 0x0006F4, 4, 0x0000000A },					//win6106
+};
 
-static int DTMB_InitRx_6381(struct avl6381_priv *priv)
-{
-  int ret;
+static const struct avl6381_reg avl6381_dvbc_rx[] = {
+	{ 0x000558, 4, 0x0068e778 },				//win5866
+	{ 0x00055c, 4, 0x016e3600 },				//win5862
+	{ 0x000560, 4, 0x0d59f800 },				//win5854
+	{ 0x00057c, 1, 0x00 },	/* ADC */				//win5878
+	{ 0x00057d, 1, 0x01 },						//win5870
+	{ 0x00057f, 1, 0x01 },						//win5874
+	{ 0x000580, 4, 0x004c4b40 },				//win5866
+	{ 0x0005a8, 4, 0x0a037a00 },				//win5858
+	{ 0x000747, 1, 0x00 },						//win5882
+};
 
-  ret = SendRxOP_6381(priv, 1);
-  if ( !ret )
-  {
-		ret |= AVL6381_WR_REG32(priv, 0x000338, 0x11E1A300);	//win5854
-		ret |= AVL6381_WR_REG32(priv, 0x000384, 0x0A037A00);	//win5858
-		ret |= AVL6381_WR_REG32(priv, 0x00033C, 0x04C4B400);	//win5862
-		ret |= AVL6381_WR_REG32(priv, 0x000304, 0x016E3600);	//win5866
-		ret |= AVL6381_WR_REG8(priv, 0x000321, 0x01);					//win5870
-		ret |= AVL6381_WR_REG8(priv, 0x000323, 0x01);					//win5874
-		ret |= AVL6381_WR_REG8(priv, 0x000319, 0x00);					//win5878
-		ret |= AVL6381_WR_REG8(priv, 0x00032B, 0x01);					//win5882
-		ret |= AVL6381_WR_REG8(priv, 0x0000A6, 0x00);					//win5886
-		ret |= DTMB_SetSpectrumPola_6381(priv, 1);	//check
-  }
-  
-  return ret;
-}
+static const struct avl6381_reg avl6381_dvbc_out[] = {
+	{ 0x000300, 4, 7560000 },	/* DTMB symbol rate, as ever */	//win5942
+	{ 0x00038B, 1, 0 },		/* no continuous mode */	//win5982
+	{ 0x00056c, 1, 0 },		/* serial order */		//win5958
+	{ 0x00056d, 1, 0 },		/* serial pin */		//win5954
+	{ 0x00056e, 1, 0 },		/* mpeg mode */			//win5946
+	{ 0x00056f, 1, 1 },						//win5950
+	{ 0x000570, 1, 0 },		/* error polarity */		//win5970
+	{ 0x000573, 1, 0 },		/* packet length */		//win5978
+	{ 0x000578, 1, 1 },		/* error bit */			//win5966
+	{ 0x00059f, 1, 0 },		/* AGC polarity */		//win6018
+	{ 0x0006F4, 4, 0x0000000A },					//win6106
+	{ 0x00074e, 1, 0 },		/* serial sync pulse */		//win5962
+	{ 0x00074f, 1, 0 },		/* valid polarity */		//win5974
+};
 
-static int DTMB_InitADC_6381(struct avl6381_priv *priv)
+static int avl6381_wr_table(struct avl6381_priv *priv,
+	const struct avl6381_reg *tbl, int n)
 {
-  int ret;
+	int i, ret = 0;
 
-//	ret = AVL6381_WR_REG8(priv, 0x000320, 0x01);
-	ret = AVL6381_WR_REG8(priv, 0x000320, 0x00);	//check
-//	ret |= AVL6381_WR_REG8(priv, 0x000324, 0x00);
-	ret |= AVL6381_WR_REG8(priv, 0x0004d7, 0x00);	//check
-	ret |= SendRxOP_6381(priv, 9);												//win5906
-		
-	return ret;
+	avl6381_batch_begin(priv);
+	for (i = 0; i < n; i++)
+		ret |= avl6381_i2c_wr_reg(priv, tbl[i].addr, tbl[i].val,
+					  tbl[i].size);
+	return ret | avl6381_batch_end(priv);
 }
 
 static int InitSDRAM_6381(struct avl6381_priv *priv)
@@ -546,266 +1127,69 @@ static int InitSDRAM_6381(struct avl6381_priv *priv)
   return ret;
 }
 
-static int IRx_Initialize_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
+static int DTMB_SetSymbolRate_6381(struct avl6381_priv *priv, unsigned int a2)
 {
-	int ret;
-
-	if (delivery_system == SYS_DVBC_ANNEX_A)
-  {
-    ret = DVBC_InitRx_6381(priv);
-    ret |= DVBC_InitADC_6381(priv);
-  }
-  else
-  {
-    ret = DTMB_InitRx_6381(priv);
-    ret |= DTMB_InitADC_6381(priv);
-  }
-  ret |= InitSDRAM_6381(priv);
-
-  return ret;
+	return AVL6381_WR_REG32(priv, 0x000300, a2);			//win5942	w8 0x00735B40
 }
 
-static int DTMB_SetSymbolRate_6381(struct avl6381_priv *priv, unsigned int a2)
+static int EnableMpegOutput_6381(struct avl6381_priv *priv)
 {
-	return AVL6381_WR_REG32(priv, 0x000300, a2);			//win5942	w8 0x00735B40
+	return AVL6381_WR_REG32(priv, 0x108030, 0x00000FFF);				//win5986 w32 0x00000FFF	
 }
 
-static int DTMB_SetMpegMode_6381(struct avl6381_priv *priv)
+static int TunerI2C_Initialize_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
 {
   int ret;
+  u32 reg;
+  
+ 	ret = AVL6381_WR_REG32(priv, 0x118000, 0x01);												//win5990
+	// close gate
+	ret |= AVL6381_I2CBypassOff(priv);
+//	ret |= AVL6381_WR_REG32(priv, 0x11801C, 0x6);												//win5994
+	
+	ret |= AVL6381_RD_REG32(priv, 0x118004, &reg);											//win5998
+	reg &= 0xfffffffe;
+	ret |= AVL6381_WR_REG32(priv, 0x118004, reg);											//win6006
 
-	ret = AVL6381_WR_REG8(priv, 0x000352, 1);	//check ??					//win5946
-	ret |= AVL6381_WR_REG8(priv, 0x000353, 1);						//win5950
+	// set bit clock
+//	ret |= AVL6381_WR_REG32(priv, 0x118018, I2C_RPT_DIV);		//win6010		data? 2B 1E
+	switch (delivery_system) {  
+	case SYS_DVBT:
+	case SYS_DVBT2:
+		ret |= AVL6381_WR_REG32(priv, 0x118018, 0x34);		//win6010		data? 2B 1E
+    break;
+	case SYS_DVBC_ANNEX_A:
+		ret |= AVL6381_WR_REG32(priv, 0x118018, 0x27);		//win6010		data? 2B 1E
+    break;
+	}
+	
+	// release from reset
+	ret |= AVL6381_WR_REG32(priv, 0x118000, 0);													//win6014
 
   return ret;
 }
 
-static int DVBC_SetMpegMode_6381(struct avl6381_priv *priv)
+static int EnableAGC_6381(struct avl6381_priv *priv)
 {
-  int ret;
-
-	ret = AVL6381_WR_REG8(priv, 0x00056e, 0);						//win5946
-	ret |= AVL6381_WR_REG8(priv, 0x00056f, 1);						//win5950
-
-  return ret;
+	return AVL6381_WR_REG32(priv, 0x108034, 0x00000001);																				//win6022
 }
 
-static int SetMpegMode_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
+static int ResetPER_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
 {
-  int ret;
+	int ret;
+	u32 uiTemp = 0;
+
+	ret = AVL6381_RD_REG32(priv, 0x149104, &uiTemp);							//win6070
+	uiTemp |= 0x00000001;
+	ret |= AVL6381_WR_REG32(priv, 0x149104, uiTemp);							//win6078
 
-	ret = 0;
 	switch (delivery_system) {  
 	case SYS_DVBT:
 	case SYS_DVBT2:
-    ret = DTMB_SetMpegMode_6381(priv);
+		ret |= AVL6381_WR_REG8(priv, 0x0000A5, 0x00);									//win6082
     break;
 	case SYS_DVBC_ANNEX_A:
-    ret = DVBC_SetMpegMode_6381(priv);
-    break;
-  }
-  return ret;
-}
-
-static int SetMpegSerialPin_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-  int ret;
-
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG8(priv, 0x000351, 0);						//win5954
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG8(priv, 0x00056d, 0);						//win5954
-    break;
-  }
-
-  return ret;
-}
-
-static int SetMpegSerialOrder_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-  int ret;
-
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG8(priv, 0x000350, 0);						//win5958
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG8(priv, 0x00056c, 0);						//win5958
-    break;
-  }
-  
-  return ret;
-}
-
-static int SetMpegSerialSyncPulse_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-  int ret;
-
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG8(priv, 0x0004E6, 0);						//win5962
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG8(priv, 0x00074e, 0);						//win5962
-    break;
-  }
-  
-  return ret;
-}
-
-static int SetMpegErrorBit_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-  int ret;
-
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG8(priv, 0x000378, 1);						//win5966
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG8(priv, 0x000578, 1);						//win5966
-    break;
-  }
-  
-  return ret;
-}
-
-static int SetMpegErrorPola_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-  int ret;
-
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG8(priv, 0x000354, 0);						//win5970
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG8(priv, 0x000570, 0);						//win5970
-    break;
-  }
-  
-  return ret;
-}
-
-static int SetMpegValidPola_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-  int ret;
-
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG8(priv, 0x0004E7, 0);						//win5974
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG8(priv, 0x00074f, 0);						//win5974
-    break;
-  }
-  
-  return ret;
-}
-
-static int SetMpegPacketLen_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-  int ret;
-
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG8(priv, 0x000357, 0);						//win5978
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG8(priv, 0x000573, 0);						//win5978
-    break;
-  }
-  
-  return ret;
-}
-
-static int DTMB_DisableMpegContinuousMode_6381(struct avl6381_priv *priv)
-{
-	return AVL6381_WR_REG8(priv, 0x00038B, 0);						//win5982
-}
-
-static int EnableMpegOutput_6381(struct avl6381_priv *priv)
-{
-	return AVL6381_WR_REG32(priv, 0x108030, 0x00000FFF);				//win5986 w32 0x00000FFF	
-}
-
-static int TunerI2C_Initialize_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-  int ret;
-  u32 reg;
-  
- 	ret = AVL6381_WR_REG32(priv, 0x118000, 0x01);												//win5990
-	// close gate
-	ret |= AVL6381_I2CBypassOff(priv);
-//	ret |= AVL6381_WR_REG32(priv, 0x11801C, 0x6);												//win5994
-	
-	ret |= AVL6381_RD_REG32(priv, 0x118004, &reg);											//win5998
-	reg &= 0xfffffffe;
-	ret |= AVL6381_WR_REG32(priv, 0x118004, reg);											//win6006
-
-	// set bit clock
-//	ret |= AVL6381_WR_REG32(priv, 0x118018, I2C_RPT_DIV);		//win6010		data? 2B 1E
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG32(priv, 0x118018, 0x34);		//win6010		data? 2B 1E
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG32(priv, 0x118018, 0x27);		//win6010		data? 2B 1E
-    break;
-	}
-	
-	// release from reset
-	ret |= AVL6381_WR_REG32(priv, 0x118000, 0);													//win6014
-
-  return ret;
-}
-
-static int SetAGCPola_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-	int ret;
-	
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret = AVL6381_WR_REG8(priv, 0x00030B, 0);																									//win6018
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret = AVL6381_WR_REG8(priv, 0x00059f, 0);																									//win6018   ?
-    break;
-	}
-	
-  return ret;
-}
-
-static int EnableAGC_6381(struct avl6381_priv *priv)
-{
-	return AVL6381_WR_REG32(priv, 0x108034, 0x00000001);																				//win6022
-}
-
-static int ResetPER_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
-{
-	int ret;
-	u32 uiTemp = 0;
-
-	ret = AVL6381_RD_REG32(priv, 0x149104, &uiTemp);							//win6070
-	uiTemp |= 0x00000001;
-	ret |= AVL6381_WR_REG32(priv, 0x149104, uiTemp);							//win6078
-
-	switch (delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-		ret |= AVL6381_WR_REG8(priv, 0x0000A5, 0x00);									//win6082
-    break;
-	case SYS_DVBC_ANNEX_A:
-		ret |= AVL6381_WR_REG16(priv, 0x0001a2, 0x0000);				//check
+		ret |= AVL6381_WR_REG16(priv, 0x0001a2, 0x0000);				//check
     break;
 	}
 	
@@ -839,6 +1223,7 @@ static int InitErrorStat_6381(struct avl6381_priv *priv, enum fe_delivery_system
 {
 	int ret;
 	
+	avl6381_batch_begin(priv);
  	ret = AVL6381_WR_REG32(priv,	0x149160, 0x00000001);					//win6026
 	ret |= AVL6381_WR_REG32(priv, 0x14912C, 0x00000001);					//win6030
 	ret |= AVL6381_WR_REG32(priv, 0x149130, 0x0A037A00);					//win6034
@@ -847,47 +1232,110 @@ static int InitErrorStat_6381(struct avl6381_priv *priv, enum fe_delivery_system
 	ret |= AVL6381_WR_REG32(priv, 0x14913C, 0x00000000);					//win6046
 
   ret |= ResetErrorStat_6381(priv, delivery_system);
+	ret |= avl6381_batch_end(priv);
 
   return ret;
 }
 
+/* receiver, MPEG, tuner i2c and AGC setup once the firmware runs a mode */
+static int AVL6381_ConfigMode(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
+{
+	int ret;
+	int dtmb = delivery_system != SYS_DVBC_ANNEX_A;
+
+	ret = SendRxOP_6381(priv, 1);
+	if (ret)
+		return ret;
+
+	avl6381_batch_begin(priv);
+	if (dtmb) {
+		ret |= avl6381_wr_table(priv, avl6381_dtmb_rx,
+					ARRAY_SIZE(avl6381_dtmb_rx));
+		ret |= DTMB_SetSpectrumPola_6381(priv, 1);	//check
+		ret |= SendRxOP_6381(priv, 9);				//win5906
+	} else {
+		ret |= avl6381_wr_table(priv, avl6381_dvbc_rx,
+					ARRAY_SIZE(avl6381_dvbc_rx));
+	}
+
+	/* the SDRAM setup survives mode changes, only a core reset drops it */
+	if (!fast_switch || !priv->sdram_inited) {
+		ret |= InitSDRAM_6381(priv);
+		priv->sdram_inited = !ret;
+	}
+
+	if (dtmb)
+		ret |= avl6381_wr_table(priv, avl6381_dtmb_out,
+					ARRAY_SIZE(avl6381_dtmb_out));
+	else
+		ret |= avl6381_wr_table(priv, avl6381_dvbc_out,
+					ARRAY_SIZE(avl6381_dvbc_out));
+
+	/* hardware registers, the shadow drops them when nothing changes */
+	ret |= EnableMpegOutput_6381(priv);
+	ret |= TunerI2C_Initialize_6381(priv, delivery_system);
+	ret |= EnableAGC_6381(priv);
+	ret |= InitErrorStat_6381(priv, delivery_system);
+	ret |= avl6381_batch_end(priv);
+
+	return ret;
+}
+
+static int GetMode_6381(struct avl6381_priv *priv, u32 *mode);
+
+/* the patch is already running: only bring the mode configuration back */
+static int AVL6381_WarmStart(struct avl6381_priv *priv)
+{
+	u32 mode;
+	int ret;
+
+	ret = GetMode_6381(priv, &mode);
+	if (ret)
+		return ret;
+
+	priv->delivery_system = mode == MODE_DTMB ?
+				SYS_DVBT2 : SYS_DVBC_ANNEX_A;
+	return AVL6381_ConfigMode(priv, priv->delivery_system);
+}
+
 static int AVL6381_Initialize(struct avl6381_priv *priv)
 {
 	u32 chipid;
-	int tryno, ret;
+	int ret = 0;
+	u32 xfers = priv->i2c_xfers;
 
 	if ( !priv->inited && !AVL6381_GetChipID(priv, &chipid) )
   {
+		/* nothing in the shadow can be trusted for a chip we just met */
+		avl6381_regcache_invalidate(priv, AVL6381_REGCACHE_ALL);
+		ret = avl6381_patch_get(priv);
+		if (ret)
+			return ret;
+
+		if (avl6381_patch_running(priv)) {
+			ret = AVL6381_WarmStart(priv);
+			if (!ret) {
+				priv->inited = 1;
+				priv->warm_starts++;
+				avl6381_patch_put(priv);
+				dbg_avl("warm start, %u i2c transactions",
+						priv->i2c_xfers - xfers);
+				return 0;
+			}
+		}
+
   	priv->delivery_system = SYS_DVBC_ANNEX_A;
 		ret = IBase_Initialize_6381(priv, AVL6381PLLConfig[5]);
     if ( !ret )
     {
-      msleep(20);
-      tryno = 20;
-      while ( tryno && CheckChipReady_6381(priv))
-      {
-        msleep(20);
-        tryno--;
-      }
-      ret |= IRx_Initialize_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= DTMB_SetSymbolRate_6381(priv, 7560000);	//check
-      ret |= SetMpegMode_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= SetMpegSerialPin_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= SetMpegSerialOrder_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= SetMpegSerialSyncPulse_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= SetMpegErrorBit_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= SetMpegErrorPola_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= SetMpegValidPola_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= SetMpegPacketLen_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= DTMB_DisableMpegContinuousMode_6381(priv);
-      ret |= EnableMpegOutput_6381(priv);
-      ret |= TunerI2C_Initialize_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= SetAGCPola_6381(priv, SYS_DVBC_ANNEX_A);
-      ret |= EnableAGC_6381(priv);
-      ret |= InitErrorStat_6381(priv, SYS_DVBC_ANNEX_A);
-			ret |= AVL6381_WR_REG32(priv, 0x0006F4, 0x0000000A);																				//win6106
-			if (!ret)
+      /* the patch tail cleared 0x0000A0, no stale signature to trip on */
+      avl6381_wait(priv, AVL6381_WAIT_READY, CheckChipReady_6381, 420);
+      ret |= AVL6381_ConfigMode(priv, SYS_DVBC_ANNEX_A);
+			if (!ret) {
 				priv->inited = 1;
+				avl6381_patch_put(priv);
+			}
+			dbg_avl("%u i2c transactions", priv->i2c_xfers - xfers);
 		}
   }
   return ret;
@@ -948,8 +1396,8 @@ static int DVBC_GetSNR_6381(struct avl6381_priv *priv, u32 *snr)
   if ( !ret && !v9 )
   {
     ret |= AVL6381_RD_REG16(priv, 0x0001ae, snr);
+		/* start the next measurement, picked up on a later sample */
 		ret |= AVL6381_WR_REG32(priv, 0x0005d8, 0x00000001);
-    msleep(50);
   }
   
   return ret;
@@ -972,17 +1420,6 @@ static int AVL6381_GetSNR(struct avl6381_priv *priv, u32 *snr)
   return ret;
 }
 
-static s64 AVL6381QAMGetSNR(struct avl6381_priv *priv)
-{
-  s64 ret;
-  u32 v2;
-
-  v2 = 0;
-  if ( !AVL6381_GetSNR(priv, &v2) )
-    ret = v2;
-  return ret;
-}
-
 static int DVBC_Halt_6381(struct avl6381_priv *priv)
 {
 	u32 v6;
@@ -1010,7 +1447,8 @@ static int Halt_6381(struct avl6381_priv *priv, enum fe_delivery_system delivery
 	int ret;
 
   ret = SendRxOP_6381(priv, 3);
-  msleep(2);
+  avl6381_batch_sync(priv);
+  usleep_range(2000, 3000);
 	switch (delivery_system) {  
 	case SYS_DVBC_ANNEX_A:
 		ret = DVBC_Halt_6381(priv);
@@ -1090,100 +1528,208 @@ static int AutoLockChannel_6381(struct avl6381_priv *priv)
     ret = DTMB_AutoLockChannel_6381(priv);
     break;
 	case SYS_DVBC_ANNEX_A:
-    ret = SendRxOP_6381(priv, 12);
+    /* 2 acquires at the programmed symbol rate, 12 searches for it */
+    ret = SendRxOP_6381(priv, priv->fixed ? 2 : 12);
     break;
 	}
 	
   return ret;
 }
 
-static int AVL6381_AutoLock(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
+static int avl6381_halt_busy(struct avl6381_priv *priv)
 {
-  unsigned int v4;
-  int v7;
-  u32 v9;
-  int ret;
+	u32 level;
+	int ret;
 
-	v9 = 2;	
-  if ( !Halt_6381(priv, delivery_system) )
-  {
-    v4 = 0;
-    while ( v9 && v4 <= 9 )
-    {
-      ret = GetRunningLevel_6381(priv, &v9);
-      if ( ret )
-      {
-        return ret;
-      }
-      ++v4;
-      msleep(10);
-    }
-    if ( v9 )
-    {
-      ret = 16;
-    }
-    else
-    {
-      ret = AutoLockChannel_6381(priv);
-      if ( ret )
-      {
-      }
-      else
-      {
-        v7 = 0;
-        while ( v9 && v7 != 10 )
-        {
-          ret = GetRunningLevel_6381(priv, &v9);
-          if ( ret )
-          {
-            return ret;
-          }
-          ++v7;
-          msleep(10);
-        }
-      }
-    }
-  }
-  return ret;
+	ret = GetRunningLevel_6381(priv, &level);
+	return ret ? ret : level;
 }
 
-static int DTMB_NoSignalDetection_6381(struct avl6381_priv *priv, u32 *a2)
+/* DVB-C symbol rate the fixed acquire op locks to */
+static int DVBC_SetSymbolRate_6381(struct avl6381_priv *priv, u32 sr)
 {
-  int ret;
-  u32 v5;
-
-  *a2 = 0;
-  v5 = 0;
-  ret = AVL6381_RD_REG16(priv, 0x000146, &v5);
-  if ( v5 > 3u )
-    *a2 = 1;
-    
-  return ret;
+	return AVL6381_WR_REG32(priv, 0x000558, sr);		//win5866
 }
 
-static int DVBC_NoSignalDetection_6381(struct avl6381_priv *priv, u32 *a2)
+/*
+ * DTMB_SetSpectrumPola_6381 argument for a DVB inversion setting. 1 is
+ * what the driver always programmed (+5 MHz IF, the MxL603 inverts its
+ * IF output) and is the non-inverted spectrum. 0 mixes from -5 MHz
+ * instead, the mirror image. 2 also sets 0x322 and is not used.
+ */
+static unsigned int avl6381_dtmb_pola(enum fe_spectral_inversion inversion)
 {
-	return AVL6381_RD_REG32(priv, 0x0001b8, a2);
+	switch (inversion) {
+	case INVERSION_ON:
+		return 0;
+	case INVERSION_OFF:
+	default:
+		return 1;
+	}
 }
 
-static int AVL6381_NoSignalDetection(struct avl6381_priv *priv, u32 *a2)
+static struct avl6381_chan *avl6381_chan_find(struct avl6381_priv *priv,
+	u32 frequency, u32 delsys)
 {
-  int ret;
+	int i;
 
-	switch (priv->delivery_system) {  
-	case SYS_DVBT:
-	case SYS_DVBT2:
-    ret = DTMB_NoSignalDetection_6381(priv, a2);
-    break;
-	case SYS_DVBC_ANNEX_A:
-    ret = DVBC_NoSignalDetection_6381(priv, a2);
-    break;
-	}
-	
-  return ret;
+	for (i = 0; i < AVL6381_CHAN_CACHE_SIZE; i++)
+		if (priv->chans[i].frequency == frequency &&
+				priv->chans[i].delsys == delsys)
+			return &priv->chans[i];
+	return NULL;
 }
 
-static int GetMode_6381(struct avl6381_priv *priv, u32 *mode)
+/* the entry for frequency, taking a free or the least recently used slot */
+static struct avl6381_chan *avl6381_chan_slot(struct avl6381_priv *priv,
+	u32 frequency, u32 delsys)
+{
+	struct avl6381_chan *ch = avl6381_chan_find(priv, frequency, delsys);
+	int i;
+
+	if (ch)
+		return ch;
+	ch = &priv->chans[0];
+	for (i = 0; i < AVL6381_CHAN_CACHE_SIZE; i++) {
+		if (!priv->chans[i].frequency) {
+			ch = &priv->chans[i];
+			break;
+		}
+		if ((s32)(priv->chans[i].used - ch->used) < 0)
+			ch = &priv->chans[i];
+	}
+	return ch;
+}
+
+/* the tune in priv->learn locked after lock_us, remember how */
+static void avl6381_chan_learn(struct avl6381_priv *priv, s64 lock_us)
+{
+	struct avl6381_chan *ch;
+
+	ch = avl6381_chan_slot(priv, priv->learn.frequency, priv->learn.delsys);
+	*ch = priv->learn;
+	ch->lock_us = lock_us;
+	ch->used = priv->chan_clock;
+	priv->learn_pending = 0;
+	dbg_avl("%u Hz: sr %u pola %u locked in %u us", ch->frequency,
+		ch->symbol_rate, ch->pola, ch->lock_us);
+}
+
+/*
+ * Program what userspace already knows about the channel. Only the DVB-C
+ * symbol rate changes the way the demod acquires; the DTMB lock stays
+ * automatic, it just starts from the given spectrum polarity. No
+ * register is known for the QAM order or the DTMB carrier mode, code rate
+ * and guard interval, so those are always detected.
+ */
+static int AVL6381_SetParams(struct avl6381_priv *priv,
+	struct dtv_frontend_properties *c)
+{
+	struct avl6381_chan *ch;
+	u32 sr = c->symbol_rate;
+	u32 pola = avl6381_dtmb_pola(c->inversion);
+	int ret = 0;
+
+	ch = avl6381_chan_find(priv, c->frequency, c->delivery_system);
+	if (ch && fixed_params) {
+		if (!sr && ch->symbol_rate)
+			sr = ch->symbol_rate;
+		if (c->inversion == INVERSION_AUTO)
+			pola = ch->pola;
+		ch->used = ++priv->chan_clock;
+		priv->chan_hits++;
+	}
+	if (!fixed_params)
+		pola = 1;
+
+	priv->fixed = 0;
+	switch (c->delivery_system) {
+	case SYS_DVBT:
+	case SYS_DVBT2:
+		/* DTMB has a single rate, a DVB-C one may be left in the cache */
+		sr = 7560000;
+		ret |= DTMB_SetSymbolRate_6381(priv, sr);
+		ret |= DTMB_SetSpectrumPola_6381(priv, pola);
+		break;
+	case SYS_DVBC_ANNEX_A:
+		if (fixed_params && sr) {
+			ret |= DVBC_SetSymbolRate_6381(priv, sr);
+			priv->fixed = !ret;
+		}
+		break;
+	default:
+		break;
+	}
+
+	write_seqlock(&priv->stats_lock);
+	memset(&priv->learn, 0, sizeof(priv->learn));
+	priv->learn.frequency = c->frequency;
+	priv->learn.delsys = c->delivery_system;
+	/* a DVB-C rate only counts if the demod did not search */
+	priv->learn.symbol_rate =
+		c->delivery_system == SYS_DVBC_ANNEX_A && !priv->fixed ? 0 : sr;
+	priv->learn.pola = pola;
+	write_sequnlock(&priv->stats_lock);
+	priv->learn_pending = !ret;
+	return ret;
+}
+
+static unsigned int avl6381_lock_ms(enum fe_delivery_system delivery_system)
+{
+	return delivery_system == SYS_DVBC_ANNEX_A ?
+		AVL6381_LOCK_MS_DVBC : AVL6381_LOCK_MS_DTMB;
+}
+
+static int AVL6381_AutoLock(struct avl6381_priv *priv, enum fe_delivery_system delivery_system)
+{
+  int ret;
+
+  ret = Halt_6381(priv, delivery_system);
+  if ( ret )
+    return ret;
+  if ( avl6381_wait(priv, AVL6381_WAIT_HALT, avl6381_halt_busy, 100) )
+    return 16;
+  /* the level never comes back up before the acquire op, so no second wait */
+  return AutoLockChannel_6381(priv);
+}
+
+static int DTMB_NoSignalDetection_6381(struct avl6381_priv *priv, u32 *a2)
+{
+  int ret;
+  u32 v5;
+
+  *a2 = 0;
+  v5 = 0;
+  ret = AVL6381_RD_REG16(priv, 0x000146, &v5);
+  if ( v5 > 3u )
+    *a2 = 1;
+    
+  return ret;
+}
+
+static int DVBC_NoSignalDetection_6381(struct avl6381_priv *priv, u32 *a2)
+{
+	return AVL6381_RD_REG32(priv, 0x0001b8, a2);
+}
+
+static int AVL6381_NoSignalDetection(struct avl6381_priv *priv, u32 *a2)
+{
+  int ret;
+
+	switch (priv->delivery_system) {  
+	case SYS_DVBT:
+	case SYS_DVBT2:
+    ret = DTMB_NoSignalDetection_6381(priv, a2);
+    break;
+	case SYS_DVBC_ANNEX_A:
+    ret = DVBC_NoSignalDetection_6381(priv, a2);
+    break;
+	}
+	
+  return ret;
+}
+
+static int GetMode_6381(struct avl6381_priv *priv, u32 *mode)
 {
 	int v3, ret;
 	
@@ -1196,50 +1742,35 @@ static int GetMode_6381(struct avl6381_priv *priv, u32 *mode)
 
 static int AVL6381_SetMode(struct avl6381_priv *priv, enum avl6381_mode mode)
 {
-  int rep, ret;
+  int ret;
   u32 ds;
   enum fe_delivery_system delivery_system;
+  u32 xfers = priv->i2c_xfers;
+  ktime_t start = ktime_get();
 
   ret = GetMode_6381(priv, &ds);
   if ( ds != mode )
   {
-      rep = 22;
-
 			if (mode==MODE_DTMB)
 				delivery_system = SYS_DVBT2;
 			else
 				delivery_system = SYS_DVBC_ANNEX_A;
       	ret |= Halt_6381(priv, delivery_system);
-      if ( !ret )
-      {
-        while ( GetRxOP_Status_6381(priv) )
-        {
-          if ( !--rep )
-            return 16LL;
-          msleep(20);
-        }
-      }
+      if ( !ret &&
+          avl6381_wait(priv, AVL6381_WAIT_RXOP, GetRxOP_Status_6381, 440) )
+        return 16LL;
       ret |= AVL6381_WR_REG32(priv, 0x110084, 0);
-      msleep(10);
+      usleep_range(10000, 11000);
       ret |= AVL6381_WR_REG32(priv, 0x110084, 1);
+      avl6381_regcache_invalidate(priv, AVL6381_REGCACHE_FW);
+      /* the core reset takes the SDRAM setup with it */
+      priv->sdram_inited = 0;
       ret |= AVL6381_WR_REG32(priv, 0x0000a0, 0);
-      if ( !(SendRxOP_6381(priv, 10) | ret) )
-      {
-        rep = 202;
-        while ( GetRxOP_Status_6381(priv) )
-        {
-          if ( !--rep )
-            return 16LL;
-          msleep(20);
-        }
-      }
-      rep = 22;
-      while ( CheckChipReady_6381(priv) )
-      {
-        if ( !--rep )
-          return 16LL;
-        msleep(20);
-      }
+      if ( !(SendRxOP_6381(priv, 10) | ret) &&
+          avl6381_wait(priv, AVL6381_WAIT_RXOP, GetRxOP_Status_6381, 4040) )
+        return 16LL;
+      if ( avl6381_wait(priv, AVL6381_WAIT_READY, CheckChipReady_6381, 440) )
+        return 16LL;
 			ret |= AVL6381_WR_REG32(priv, 0x110840, 1);
 			
 			switch (delivery_system) {
@@ -1254,37 +1785,22 @@ static int AVL6381_SetMode(struct avl6381_priv *priv, enum avl6381_mode mode)
 			}
 //      msleep(50);
 //			ret |= AVL6381_WR_REG32(priv, 0x0000a0, 0);	//check
-      msleep(20);
+      usleep_range(20000, 21000);
 			ret |= AVL6381_WR_REG32(priv, 0x110840, 0);
 
-    rep = 200;
-    msleep(20);
-    while ( CheckChipReady_6381(priv) )
-    {
-      msleep(20);
-      if ( !--rep )
-        return 16LL;
-    }
+    /* 0x0000A0 still holds the signature from before the PLL change */
+    usleep_range(20000, 21000);
+    if ( avl6381_wait(priv, AVL6381_WAIT_READY, CheckChipReady_6381, 4000) )
+      return 16LL;
 
-    ret |= IRx_Initialize_6381(priv, delivery_system);
-    if ( delivery_system == SYS_DVBT | delivery_system == SYS_DVBT2 ) //check
-      ret |= DTMB_SetSymbolRate_6381(priv, 7560000);
-    ret |= SetMpegMode_6381(priv, delivery_system);
-    ret |= SetMpegSerialPin_6381(priv, delivery_system);
-    ret |= SetMpegSerialOrder_6381(priv, delivery_system);
-    ret |= SetMpegSerialSyncPulse_6381(priv, delivery_system);
-    ret |= SetMpegErrorBit_6381(priv, delivery_system);
-    ret |= SetMpegErrorPola_6381(priv, delivery_system);
-    ret |= SetMpegValidPola_6381(priv, delivery_system);
-    ret |= SetMpegPacketLen_6381(priv, delivery_system);
-    ret |= DTMB_DisableMpegContinuousMode_6381(priv);
-    ret |= EnableMpegOutput_6381(priv);
-    ret |= TunerI2C_Initialize_6381(priv, delivery_system);
-    ret |= SetAGCPola_6381(priv, delivery_system);
-    ret |= EnableAGC_6381(priv);
-    ret |= InitErrorStat_6381(priv, delivery_system);
-    ret |= AVL6381_WR_REG32(priv, 0x0006F4, 0x0000000A);																				//win6106
-    
+    ret |= AVL6381_ConfigMode(priv, delivery_system);
+    if (!ret) {
+      priv->switches[mode]++;
+      priv->switch_us[mode] = ktime_us_delta(ktime_get(), start);
+    }
+    dbg_avl("to %s: %lld us, %u i2c transactions",
+        mode == MODE_DTMB ? "DTMB" : "DVB-C", priv->switch_us[mode],
+        priv->i2c_xfers - xfers);
   }
   return ret;
 }
@@ -1337,21 +1853,10 @@ static int avl6381_i2c_gate_ctrl(struct dvb_frontend *fe, int enable)
 
 	dev_dbg(&priv->i2c->dev, "%s: %d\n", __func__, enable);
 
-	if (enable) {
+	if (enable)
 		ret = AVL6381_I2CBypassOn(priv);
-		ret |= AVL6381_I2CBypassOn(priv);
-		ret |= AVL6381_I2CBypassOn(priv);
-		ret |= AVL6381_I2CBypassOn(priv);
-		ret |= AVL6381_I2CBypassOn(priv);
-	}
 	else
-	{
 		ret = AVL6381_I2CBypassOff(priv);
-		ret |= AVL6381_I2CBypassOff(priv);
-		ret |= AVL6381_I2CBypassOff(priv);
-		ret |= AVL6381_I2CBypassOff(priv);
-		ret |= AVL6381_I2CBypassOff(priv);
-	}
 	
 	return ret;
 }
@@ -1359,88 +1864,260 @@ static int avl6381_i2c_gate_ctrl(struct dvb_frontend *fe, int enable)
 
 //#define I2C_RPT_DIV ((0x2A)*(250000)/(240*1000))	//m_CoreFrequency_Hz 250000000
 
-static int avl6381_read_status(struct dvb_frontend *fe, enum fe_status *status)
+static void avl6381_outage_end(struct avl6381_priv *priv, ktime_t now)
 {
-	struct avl6381_priv *priv = fe->demodulator_priv;
-	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
-	int ret = 0;
-	u32 st=0, reg1, reg2;
-	s64 snr = 0;
+	s64 us = ktime_us_delta(now, priv->outage_start);
 
-	mutex_lock(&priv->mutex);
+	if (priv->wd_stage != AVL6381_WD_RETUNE)
+		priv->outage_reacquired++;
+	else
+		priv->outage_retuned++;
+	priv->outage_last_us = us;
+	priv->outage_total_us += us;
+	if (us > priv->outage_max_us)
+		priv->outage_max_us = us;
+	dbg_avl("lock back after %lld us", us);
+}
 
-	*status  = 0;
-	u16 strength = 0;
-	int v5 = 29 ;
-	while (v5>0 && !AVL6381_GetLockStatus(priv, &st))
-	{
-		if (st)
-		{
-			strength = 0;
-			if (fe->ops.tuner_ops.get_rf_strength && fe->ops.tuner_ops.get_rf_strength(fe, &strength))
-			{
-				return 0;
-			}
-			if (strength)
-			{
-				*status |= FE_HAS_SYNC | FE_HAS_LOCK;
-				break;
-			}
+/*
+ * Lock was there and is gone: let the demod re-acquire on the tuner
+ * setting it has, which is all a short fade needs. Only when that does
+ * not lock within the acquire budget is the whole tune redone, every
+ * wd_retune_ms until the lock is back. Called locked from the collector,
+ * so it never waits on the chip: the halt and the acquire op go out on
+ * separate samples, and retunes are left to avl6381_tune_step.
+ */
+static void avl6381_watchdog(struct avl6381_priv *priv, int locked)
+{
+	ktime_t now = ktime_get();
+
+	switch (priv->wd_stage) {
+	case AVL6381_WD_IDLE:
+		if (locked)
+			priv->wd_stage = AVL6381_WD_ARMED;
+		break;
+
+	case AVL6381_WD_ARMED:
+		if (locked)
+			break;
+		priv->outages++;
+		priv->outage_start = now;
+		priv->wd_deadline = ktime_add_ms(now,
+				avl6381_lock_ms(priv->delivery_system));
+		priv->wd_stage = AVL6381_WD_HALT;
+		dbg_avl("lock lost, reacquiring");
+		Halt_6381(priv, priv->delivery_system);
+		break;
+
+	case AVL6381_WD_HALT:
+	case AVL6381_WD_REACQUIRE:
+	case AVL6381_WD_RETUNE:
+		if (locked) {
+			avl6381_outage_end(priv, now);
+			priv->wd_stage = AVL6381_WD_ARMED;
+			break;
+		}
+		if (ktime_after(now, priv->wd_deadline)) {
+			dbg_avl("still no lock, retuning");
+			priv->wd_deadline = ktime_add_ms(now, wd_retune_ms);
+			priv->wd_stage = AVL6381_WD_RETUNE;
+			priv->wd_retune = 1;
+			break;
+		}
+		if (priv->wd_stage == AVL6381_WD_HALT &&
+				!avl6381_halt_busy(priv)) {
+			AutoLockChannel_6381(priv);
+			priv->wd_stage = AVL6381_WD_REACQUIRE;
 		}
-		msleep(20);
-		--v5;
+		break;
 	}
+}
 
-	if (status)
-	{
-		snr = AVL6381QAMGetSNR(priv);
+/*
+ * Sample lock, RF strength, SNR and BER on the collector's own cadence:
+ * stats_fast_ms while the lock state is changing, stats_slow_ms once it
+ * has held for AVL6381_STATS_SETTLE samples.
+ */
+static void avl6381_stats_work(struct work_struct *work)
+{
+	struct avl6381_priv *priv = container_of(to_delayed_work(work),
+					struct avl6381_priv, stats_work);
+	struct dvb_frontend *fe = &priv->frontend;
+	struct avl6381_snapshot snap;
+	u32 st = 0, snr;
+	unsigned int ms;
 
-		AVL6381_RD_REG32(priv, 0x149110, &reg1);
-		AVL6381_RD_REG32(priv, 0x149114, &reg2);
-	//	AVL6381_RD_REG8(priv, 0x0000a5, &reg);
+	mutex_lock(&priv->mutex);
+	if (!priv->stats_active) {
+		mutex_unlock(&priv->mutex);
+		return;
+	}
 
-		c->strength.stat[0].scale = FE_SCALE_DECIBEL;
-		c->strength.stat[0].svalue = (~strength + 1)*10;
+	snap = priv->snap;
+	snap.status = 0;
+	if (!AVL6381_GetLockStatus(priv, &st) && st) {
+		snap.strength = 0;
+		if (fe->ops.tuner_ops.get_rf_strength)
+			fe->ops.tuner_ops.get_rf_strength(fe, &snap.strength);
+		if (snap.strength)
+			snap.status |= AVL6381_FE_LOCKED;
+	}
 
-		c->cnr.stat[0].scale = FE_SCALE_DECIBEL;
-		c->cnr.stat[0].svalue = snr * 10;
-		
-		c->pre_bit_error.stat[0].scale = FE_SCALE_COUNTER;
-		c->pre_bit_error.stat[0].uvalue = reg1;
-		c->pre_bit_count.stat[0].scale = FE_SCALE_COUNTER;
-		c->pre_bit_count.stat[0].uvalue = reg2;
+	/* DVB-C leaves snr alone while a measurement is still running */
+	snr = snap.snr;
+	if (!AVL6381_GetSNR(priv, &snr))
+		snap.snr = snr;
+	AVL6381_RD_REG32(priv, 0x149110, &snap.ber_err);
+	AVL6381_RD_REG32(priv, 0x149114, &snap.ber_cnt);
 
-	//	c->block_error.stat[0].scale = FE_SCALE_COUNTER;
-	//	c->block_error.stat[0].uvalue = reg1;
-	//	c->block_count.stat[0].scale = FE_SCALE_COUNTER;
-	//	c->block_error.stat[0].uvalue = reg2;
+	if ((snap.status & FE_HAS_LOCK) && priv->learn_pending)
+		avl6381_chan_learn(priv,
+			ktime_us_delta(ktime_get(), priv->tune_start));
 
-	//dev_info(&priv->i2c->dev, "st:%d snr:%d strength:%d status:%x, reg1:%d, reg2:%d", st, snr, strength, *status, reg1, reg2);
-	}
+	if (snap.status == priv->snap.status)
+		priv->stats_stable++;
+	else
+		priv->stats_stable = 0;
+	priv->stats_samples++;
+
+	write_seqlock(&priv->stats_lock);
+	priv->snap = snap;
+	write_sequnlock(&priv->stats_lock);
+
+	if (watchdog)
+		avl6381_watchdog(priv, snap.status & FE_HAS_LOCK);
+
+	/* a steady lock, or a channel that steadily has none */
+	if (priv->stats_stable >= AVL6381_STATS_SETTLE)
+		ms = stats_slow_ms;
+	else
+		ms = stats_fast_ms;
+	schedule_delayed_work(&priv->stats_work, msecs_to_jiffies(ms));
 	mutex_unlock(&priv->mutex);
+}
 
-	return ret;
+/* forget the old channel and sample at the fast rate, called locked */
+static void avl6381_stats_reset(struct avl6381_priv *priv)
+{
+	write_seqlock(&priv->stats_lock);
+	memset(&priv->snap, 0, sizeof(priv->snap));
+	write_sequnlock(&priv->stats_lock);
+	priv->stats_stable = 0;
 }
 
-static enum dvbfe_algo avl6862fe_algo(struct dvb_frontend *fe)
+/*
+ * Arm the collector, the first tune starts it. It reads the tuner, which
+ * the core initialises only after avl6381_init, so it must not run yet.
+ */
+static void avl6381_stats_start(struct avl6381_priv *priv)
 {
-	return DVBFE_ALGO_HW;
+	mutex_lock(&priv->mutex);
+	priv->stats_active = 1;
+	priv->wd_stage = AVL6381_WD_IDLE;
+	avl6381_stats_reset(priv);
+	mutex_unlock(&priv->mutex);
 }
-			
 
-static int avl6381_set_frontend(struct dvb_frontend *fe)
+static void avl6381_stats_stop(struct avl6381_priv *priv)
+{
+	mutex_lock(&priv->mutex);
+	priv->stats_active = 0;
+	mutex_unlock(&priv->mutex);
+	cancel_delayed_work_sync(&priv->stats_work);
+}
+
+static int avl6381_read_status(struct dvb_frontend *fe, enum fe_status *status)
 {
 	struct avl6381_priv *priv = fe->demodulator_priv;
 	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
-	u32 demod_mode;
+	struct avl6381_snapshot snap;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&priv->stats_lock);
+		snap = priv->snap;
+	} while (read_seqretry(&priv->stats_lock, seq));
+
+	*status = snap.status;
+	if ((snap.status & FE_HAS_LOCK) && xchg(&priv->lock_pending, 0))
+		trace_avl6381_first_lock(priv->i2c->nr,
+				priv->config->demod_address, c->frequency,
+				ktime_us_delta(ktime_get(), priv->tune_start));
+
+	c->strength.stat[0].scale = FE_SCALE_DECIBEL;
+	c->strength.stat[0].svalue = (~snap.strength + 1)*10;
+
+	c->cnr.stat[0].scale = FE_SCALE_DECIBEL;
+	c->cnr.stat[0].svalue = (s64)snap.snr * 10;
+
+	c->pre_bit_error.stat[0].scale = FE_SCALE_COUNTER;
+	c->pre_bit_error.stat[0].uvalue = snap.ber_err;
+	c->pre_bit_count.stat[0].scale = FE_SCALE_COUNTER;
+	c->pre_bit_count.stat[0].uvalue = snap.ber_cnt;
+
+	return 0;
+}
+
+
+/* emit the duration of the phase that started at *t and start the next */
+static void avl6381_trace_phase(struct avl6381_priv *priv, int phase,
+	ktime_t *t, int ret)
+{
+	ktime_t now = ktime_get();
+
+	trace_avl6381_tune_phase(priv->i2c->nr, priv->config->demod_address,
+			phase, ktime_us_delta(now, *t), ret);
+	*t = now;
+}
+
+/*
+ * The request is what the demod is already locked to: same frequency and
+ * system, nothing asked for that differs from what the lock used, and the
+ * lock has been stable and is still there. Called locked.
+ */
+static int avl6381_tune_is_noop(struct avl6381_priv *priv,
+	struct dtv_frontend_properties *c)
+{
+	struct avl6381_chan *ch = &priv->learn;
+	u32 st = 0;
+
+	if (priv->learn_pending || !ch->frequency ||
+			ch->frequency != c->frequency ||
+			ch->delsys != c->delivery_system ||
+			priv->delivery_system != c->delivery_system)
+		return 0;
+	if (c->delivery_system == SYS_DVBC_ANNEX_A && c->symbol_rate &&
+			c->symbol_rate != ch->symbol_rate)
+		return 0;
+	if (c->inversion != INVERSION_AUTO &&
+			avl6381_dtmb_pola(c->inversion) != ch->pola &&
+			c->delivery_system != SYS_DVBC_ANNEX_A)
+		return 0;
+	if (!(priv->snap.status & FE_HAS_LOCK) ||
+			priv->stats_stable < AVL6381_STATS_SETTLE)
+		return 0;
+	/* the snapshot may be a slow period old */
+	return !AVL6381_GetLockStatus(priv, &st) && st;
+}
+
+/* program tuner and demod for the property cache, called locked */
+static int avl6381_tune(struct avl6381_priv *priv)
+{
+	struct dvb_frontend *fe = &priv->frontend;
+	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
 	int ret = 0;
-	u32 v29;
+	u32 xfers;
+	ktime_t t;
 
-	mutex_lock(&priv->mutex);
+	xfers = priv->i2c_xfers;
+	avl6381_stats_reset(priv);
+	t = priv->tune_start = ktime_get();
 
 	/* setup tuner */
-	if (priv->config->tuner_select_input)
+	if (priv->config->tuner_select_input) {
 		ret |= priv->config->tuner_select_input(fe, c->delivery_system);
+		avl6381_trace_phase(priv, AVL6381_PHASE_SELECT_INPUT, &t, ret);
+	}
 
 	switch (c->delivery_system) {
 	case SYS_DVBT:
@@ -1454,30 +2131,316 @@ static int avl6381_set_frontend(struct dvb_frontend *fe)
 		ret = -EINVAL;
 		break;
 	}
+	avl6381_trace_phase(priv, AVL6381_PHASE_SET_MODE, &t, ret);
+	/* everything after this talks to the new mode */
+	if (!ret)
+		priv->delivery_system = c->delivery_system;
 
-	if (fe->ops.tuner_ops.set_params)
+	if (fe->ops.tuner_ops.set_params) {
 		ret |= fe->ops.tuner_ops.set_params(fe);
+		avl6381_trace_phase(priv, AVL6381_PHASE_TUNER, &t, ret);
+	}
 
-	if (c->delivery_system==SYS_DVBT | c->delivery_system==SYS_DVBT2)
-  	ret |= DTMB_SetSymbolRate_6381(priv, 7560000);
+	ret |= AVL6381_SetParams(priv, c);
+	avl6381_trace_phase(priv, AVL6381_PHASE_PARAMS, &t, ret);
 
 	ret |= AVL6381_AutoLock(priv, c->delivery_system);
+	avl6381_trace_phase(priv, AVL6381_PHASE_AUTOLOCK, &t, ret);
 	
 	if (!ret)
 		priv->delivery_system = c->delivery_system;
-		
-	mutex_unlock(&priv->mutex);
+	priv->lock_pending = !ret;
+
+	priv->tune_xfers = priv->i2c_xfers - xfers;
+	dbg_avl("%u i2c transactions", priv->tune_xfers);
+	if (priv->stats_active)
+		mod_delayed_work(system_wq, &priv->stats_work, 0);
 	
 	return ret;
 }
 
+static int avl6381_set_frontend(struct dvb_frontend *fe)
+{
+	struct avl6381_priv *priv = fe->demodulator_priv;
+	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
+	int ret;
+
+	mutex_lock(&priv->mutex);
+	if (avl6381_tune_is_noop(priv, c)) {
+		priv->retunes_skipped++;
+		dbg_avl("%u Hz already locked", c->frequency);
+		mutex_unlock(&priv->mutex);
+		return 0;
+	}
+
+	/* a new channel, whatever the watchdog was doing is moot */
+	priv->wd_stage = AVL6381_WD_IDLE;
+	priv->wd_retune = 0;
+	ret = avl6381_tune(priv);
+	mutex_unlock(&priv->mutex);
+
+	return ret;
+}
+
+/*
+ * Report what the driver programmed for the running tune: the DVB-C
+ * symbol rate when the fixed acquire was used, the DTMB symbol rate and
+ * spectrum polarity. No register is known for the detected QAM order or
+ * DTMB carrier mode, code rate and guard interval, those stay as set.
+ * Reads a copy of priv->learn, so it never waits for a tune.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 7, 0)
+static int avl6381_get_frontend(struct dvb_frontend *fe)
+{
+	struct dtv_frontend_properties *props = &fe->dtv_property_cache;
+#else
+static int avl6381_get_frontend(struct dvb_frontend *fe,
+	struct dtv_frontend_properties *props)
+{
+#endif
+	struct avl6381_priv *priv = fe->demodulator_priv;
+	struct avl6381_chan ch;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&priv->stats_lock);
+		ch = priv->learn;
+	} while (read_seqretry(&priv->stats_lock, seq));
+
+	if (ch.frequency != props->frequency ||
+			ch.delsys != props->delivery_system)
+		return 0;
+
+	switch (props->delivery_system) {
+	case SYS_DVBT:
+	case SYS_DVBT2:
+		props->symbol_rate = ch.symbol_rate;
+		props->inversion = ch.pola ? INVERSION_OFF : INVERSION_ON;
+		break;
+	case SYS_DVBC_ANNEX_A:
+		if (ch.symbol_rate)
+			props->symbol_rate = ch.symbol_rate;
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static enum dvbfe_algo avl6381_get_frontend_algo(struct dvb_frontend *fe)
+{
+	return DVBFE_ALGO_HW;
+}
+
+/* tune_step call interval while acquiring, and once settled */
+#define AVL6381_SCAN_POLL_MS	5
+#define AVL6381_SCAN_IDLE_MS	500
+
+/*
+ * Acquisition pipeline: ask every no-signal indicator we have, the tuner
+ * AGC lock, the RF input power and the demod's no-signal flag. Returns
+ * 1 when at least nosig_votes of the available ones (all of them if
+ * fewer are available) say the channel is empty. Called locked.
+ */
+static int avl6381_no_signal(struct avl6381_priv *priv)
+{
+	struct dvb_frontend *fe = &priv->frontend;
+	u32 tuner_status, nosig;
+	u16 strength;
+	int avail = 0, votes = 0;
+
+	if (fe->ops.tuner_ops.get_status &&
+			!fe->ops.tuner_ops.get_status(fe, &tuner_status)) {
+		avail++;
+		if (!(tuner_status & TUNER_STATUS_LOCKED))
+			votes++;
+	}
+	if (fe->ops.tuner_ops.get_rf_strength &&
+			!fe->ops.tuner_ops.get_rf_strength(fe, &strength)) {
+		avail++;
+		/* strength is minus the RF power in 0.01 dBm */
+		if (-(s16)strength < nosig_rf_dbm * 100)
+			votes++;
+	}
+	if (!AVL6381_NoSignalDetection(priv, &nosig)) {
+		avail++;
+		if (nosig)
+			votes++;
+	}
+
+	return avail && votes >= min_t(int, nosig_votes, avail);
+}
+
+/* one look at the demod and tuner, called locked */
+static enum avl6381_scan_state avl6381_scan_poll(struct avl6381_priv *priv,
+	enum avl6381_scan_state state)
+{
+	u32 st = 0;
+
+	if (!AVL6381_GetLockStatus(priv, &st) && st)
+		return AVL6381_SCAN_LOCKED;
+	if (state == AVL6381_SCAN_PROBE && avl6381_no_signal(priv)) {
+		priv->scan_early_empty++;
+		return AVL6381_SCAN_EMPTY;
+	}
+	return state;
+}
+
+/*
+ * The fixed-parameter lock ran out of time, the channel list may be
+ * stale: retry once with the symbol rate search. Returns 1 if it started.
+ */
+static int avl6381_scan_fallback(struct avl6381_priv *priv)
+{
+	int ret;
+
+	if (!priv->fixed)
+		return 0;
+	mutex_lock(&priv->mutex);
+	priv->fixed = 0;
+	priv->fixed_fallbacks++;
+	/* the rate we had is stale, do not learn it again */
+	write_seqlock(&priv->stats_lock);
+	priv->learn.symbol_rate = 0;
+	write_sequnlock(&priv->stats_lock);
+	ret = AVL6381_AutoLock(priv, priv->delivery_system);
+	mutex_unlock(&priv->mutex);
+	dbg_avl("fixed lock failed, searching, ret=%d", ret);
+	return !ret;
+}
+
+/* the acquisition saw lock, publish it without waiting for the collector */
+static void avl6381_scan_locked(struct avl6381_priv *priv)
+{
+	struct dtv_frontend_properties *c = &priv->frontend.dtv_property_cache;
+
+	priv->scan_locked++;
+	if (priv->fixed)
+		priv->fixed_locks++;
+	dbg_avl("%u Hz locked in %lld us", c->frequency,
+		ktime_us_delta(ktime_get(), priv->scan_start));
+
+	write_seqlock(&priv->stats_lock);
+	priv->snap.status = AVL6381_FE_LOCKED;
+	write_sequnlock(&priv->stats_lock);
+	/* strength and CNR follow with the next sample */
+	if (priv->stats_active)
+		mod_delayed_work(system_wq, &priv->stats_work, 0);
+}
+
+/*
+ * DVBFE_ALGO_HW tune: the frontend thread calls this every *delay
+ * jiffies, with re_tune set for new parameters. Each call takes one step
+ * of TUNE -> PROBE -> WAIT_LOCK -> LOCKED/EMPTY and returns, so status
+ * changes reach userspace on the call that sees them. Channels
+ * avl6381_no_signal() calls empty within nosig_window_ms are dropped at
+ * once, only the rest are given the full lock budget. After that the
+ * status comes from the collector, whose watchdog owns lock recovery.
+ */
+static int avl6381_tune_step(struct dvb_frontend *fe, bool re_tune,
+	unsigned int mode_flags, unsigned int *delay, enum fe_status *status)
+{
+	struct avl6381_priv *priv = fe->demodulator_priv;
+	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
+	enum avl6381_scan_state state;
+	int ret;
+
+	*delay = msecs_to_jiffies(AVL6381_SCAN_POLL_MS);
+	*status = 0;
+	if (re_tune)
+		priv->scan_state = AVL6381_SCAN_TUNE;
+
+	switch (priv->scan_state) {
+	case AVL6381_SCAN_TUNE:
+		priv->scan_start = ktime_get();
+		ret = avl6381_set_frontend(fe);
+		if (ret) {
+			priv->scan_state = AVL6381_SCAN_EMPTY;
+			return ret;
+		}
+		priv->scan_deadline = ktime_add_ms(ktime_get(), nosig_window_ms);
+		priv->scan_state = AVL6381_SCAN_PROBE;
+		break;
+
+	case AVL6381_SCAN_PROBE:
+	case AVL6381_SCAN_WAIT_LOCK:
+		mutex_lock(&priv->mutex);
+		state = avl6381_scan_poll(priv, priv->scan_state);
+		if (state == AVL6381_SCAN_LOCKED)
+			avl6381_scan_locked(priv);
+		mutex_unlock(&priv->mutex);
+
+		if (state == AVL6381_SCAN_PROBE ||
+				state == AVL6381_SCAN_WAIT_LOCK) {
+			if (!ktime_after(ktime_get(), priv->scan_deadline)) {
+				*status = state == AVL6381_SCAN_WAIT_LOCK ?
+					FE_HAS_SIGNAL : 0;
+				break;
+			}
+			if (state == AVL6381_SCAN_PROBE) {
+				/* lock budget for a channel not found empty */
+				priv->scan_deadline = ktime_add_ms(
+					priv->scan_deadline,
+					avl6381_lock_ms(c->delivery_system));
+				state = AVL6381_SCAN_WAIT_LOCK;
+				*status = FE_HAS_SIGNAL;
+			} else if (avl6381_scan_fallback(priv)) {
+				priv->scan_deadline = ktime_add_ms(ktime_get(),
+					AVL6381_LOCK_MS_DVBC);
+				*status = FE_HAS_SIGNAL;
+			} else {
+				state = AVL6381_SCAN_EMPTY;
+			}
+		}
+		priv->scan_state = state;
+
+		if (state == AVL6381_SCAN_EMPTY) {
+			priv->scan_empty++;
+			dbg_avl("%u Hz empty after %lld us", c->frequency,
+				ktime_us_delta(ktime_get(), priv->scan_start));
+			*status = FE_TIMEDOUT;
+		}
+		if (state == AVL6381_SCAN_LOCKED)
+			avl6381_read_status(fe, status);
+		break;
+
+	case AVL6381_SCAN_LOCKED:
+	case AVL6381_SCAN_EMPTY:
+		/* the watchdog's retune, the collector does not tune itself */
+		mutex_lock(&priv->mutex);
+		if (priv->wd_retune) {
+			priv->wd_retune = 0;
+			avl6381_tune(priv);
+		}
+		mutex_unlock(&priv->mutex);
+		/* the demod keeps acquiring, a late lock still shows up */
+		avl6381_read_status(fe, status);
+		if (priv->scan_state == AVL6381_SCAN_EMPTY && !*status)
+			*status = FE_TIMEDOUT;
+		*delay = msecs_to_jiffies(AVL6381_SCAN_IDLE_MS);
+		break;
+	}
+	return 0;
+}
+
+/*
+ * The core puts the tuner to sleep before it calls avl6381_sleep, and
+ * without priv->mutex. Stop the collector, which reads the tuner through
+ * the same I2C gate, before the tuner's own sleep runs.
+ */
+static int avl6381_tuner_sleep(struct dvb_frontend *fe)
+{
+	struct avl6381_priv *priv = fe->demodulator_priv;
+
+	avl6381_stats_stop(priv);
+	return priv->tuner_sleep ? priv->tuner_sleep(fe) : 0;
+}
+
 static int avl6381_init(struct dvb_frontend *fe)
 {
 	struct avl6381_priv *priv = fe->demodulator_priv;
 	struct dtv_frontend_properties *c = &fe->dtv_property_cache;
 	int ret=0;
-	
-	mutex_init(&priv->mutex);
 
 	c->strength.len = 1;
 	c->strength.stat[0].scale = FE_SCALE_DECIBEL;
@@ -1494,11 +2457,42 @@ static int avl6381_init(struct dvb_frontend *fe)
 	c->block_count.len = 1;
 	c->block_count.stat[0].scale = FE_SCALE_NOT_AVAILABLE;
 
+	/* the first open waits for the initialisation attach started */
+	ret = wait_for_completion_interruptible(&priv->init_done);
+	if (ret)
+		return ret;
+
+	/* after a reset-resume the chip may have lost power and its patch */
+	if (priv->inited && !avl6381_patch_running(priv)) {
+		dev_info(&priv->i2c->dev, "%s: patch lost, reinitialising",
+				KBUILD_MODNAME);
+		priv->inited = 0;
+	}
+
+	/* a reinit, the tuner init that follows must not race the collector */
+	avl6381_stats_stop(priv);
+
 	ret = AVL6381_Initialize(priv);
+	if (!ret)
+		avl6381_stats_start(priv);
+
+	/* the tuner is attached by now, see avl6381_tuner_sleep */
+	if (fe->ops.tuner_ops.sleep != avl6381_tuner_sleep) {
+		priv->tuner_sleep = fe->ops.tuner_ops.sleep;
+		fe->ops.tuner_ops.sleep = avl6381_tuner_sleep;
+	}
 	
 	return ret;
 }
 
+static int avl6381_sleep(struct dvb_frontend *fe)
+{
+	struct avl6381_priv *priv = fe->demodulator_priv;
+
+	avl6381_stats_stop(priv);
+	return 0;
+}
+
 /*static int avl6381_set_sleep(struct dvb_frontend *fe)
 {
 	int ret;
@@ -1511,9 +2505,186 @@ static int avl6381_init(struct dvb_frontend *fe)
 	return ret;
 }*/
 
+static int avl6381_stats_show(struct seq_file *s, void *data)
+{
+	struct avl6381_priv *priv = s->private;
+
+	seq_printf(s, "i2c_xfers:     %u\n", priv->i2c_xfers);
+	seq_printf(s, "tune_xfers:    %u\n", priv->tune_xfers);
+	seq_printf(s, "reg_wr_skips:  %u\n", priv->reg_wr_skips);
+	seq_printf(s, "reg_rd_hits:   %u\n", priv->reg_rd_hits);
+	seq_printf(s, "patch_bytes:   %u\n", priv->patch_bytes);
+	seq_printf(s, "patch_xfers:   %u\n", priv->patch_xfers);
+	seq_printf(s, "patch_us:      %lld\n", priv->patch_us);
+	seq_printf(s, "warm_starts:   %u\n", priv->warm_starts);
+	seq_printf(s, "stats_samples: %u\n", priv->stats_samples);
+	seq_printf(s, "scan_locked:   %u\n", priv->scan_locked);
+	seq_printf(s, "scan_empty:    %u (%u early)\n",
+			priv->scan_empty, priv->scan_early_empty);
+	seq_printf(s, "fixed_locks:   %u (%u fell back)\n",
+			priv->fixed_locks, priv->fixed_fallbacks);
+	seq_printf(s, "chan_hits:     %u\n", priv->chan_hits);
+	seq_printf(s, "retune_skips:  %u\n", priv->retunes_skipped);
+	seq_printf(s, "outages:       %u (%u reacquired, %u retuned)\n",
+			priv->outages, priv->outage_reacquired,
+			priv->outage_retuned);
+	seq_printf(s, "outage_us:     last %lld max %lld total %lld\n",
+			priv->outage_last_us, priv->outage_max_us,
+			priv->outage_total_us);
+	seq_printf(s, "to_dtmb:       %u, last %lld us\n",
+			priv->switches[MODE_DTMB], priv->switch_us[MODE_DTMB]);
+	seq_printf(s, "to_dvbc:       %u, last %lld us\n",
+			priv->switches[MODE_DVBC], priv->switch_us[MODE_DVBC]);
+	return 0;
+}
+
+static int avl6381_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, avl6381_stats_show, inode->i_private);
+}
+
+static const struct file_operations avl6381_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= avl6381_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const char * const avl6381_wait_names[AVL6381_WAIT_NR] = {
+	[AVL6381_WAIT_RXOP]	= "rxop",
+	[AVL6381_WAIT_READY]	= "ready",
+	[AVL6381_WAIT_HALT]	= "halt",
+};
+
+/* one line per wait: "<op> timeouts=N <2^n us>:count ..." */
+static int avl6381_waits_show(struct seq_file *s, void *data)
+{
+	struct avl6381_priv *priv = s->private;
+	struct avl6381_wait_stats *ws;
+	int op, i;
+
+	for (op = 0; op < AVL6381_WAIT_NR; op++) {
+		ws = &priv->waits[op];
+		seq_printf(s, "%-6s timeouts=%u", avl6381_wait_names[op],
+				ws->timeouts);
+		for (i = 0; i < AVL6381_WAIT_BUCKETS; i++)
+			if (ws->hist[i])
+				seq_printf(s, " <%lluus:%u", 1ULL << i, ws->hist[i]);
+		seq_puts(s, "\n");
+	}
+	return 0;
+}
+
+static int avl6381_waits_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, avl6381_waits_show, inode->i_private);
+}
+
+static const struct file_operations avl6381_waits_fops = {
+	.owner		= THIS_MODULE,
+	.open		= avl6381_waits_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * The channel cache as "<frequency> <delsys> <symbol_rate> <pola> <lock_us>"
+ * lines. Writing lines back in that format (e.g. saved at shutdown) adds
+ * them to the cache.
+ */
+static int avl6381_chans_show(struct seq_file *s, void *data)
+{
+	struct avl6381_priv *priv = s->private;
+	struct avl6381_chan *ch;
+	int i;
+
+	mutex_lock(&priv->mutex);
+	for (i = 0; i < AVL6381_CHAN_CACHE_SIZE; i++) {
+		ch = &priv->chans[i];
+		if (ch->frequency)
+			seq_printf(s, "%u %u %u %u %u\n", ch->frequency,
+				ch->delsys, ch->symbol_rate, ch->pola,
+				ch->lock_us);
+	}
+	mutex_unlock(&priv->mutex);
+	return 0;
+}
+
+static int avl6381_chans_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, avl6381_chans_show, inode->i_private);
+}
+
+static ssize_t avl6381_chans_write(struct file *file, const char __user *ubuf,
+	size_t count, loff_t *ppos)
+{
+	struct avl6381_priv *priv = ((struct seq_file *)file->private_data)->private;
+	struct avl6381_chan in, *ch;
+	char *buf, *p, *line;
+	int ret = count;
+
+	if (count > PAGE_SIZE * 4)
+		return -E2BIG;
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	mutex_lock(&priv->mutex);
+	p = buf;
+	while ((line = strsep(&p, "\n"))) {
+		line = strim(line);
+		if (!*line)
+			continue;
+		memset(&in, 0, sizeof(in));
+		if (sscanf(line, "%u %u %u %u %u", &in.frequency, &in.delsys,
+				&in.symbol_rate, &in.pola, &in.lock_us) != 5 ||
+				!in.frequency || in.pola > 1) {
+			ret = -EINVAL;
+			break;
+		}
+		ch = avl6381_chan_slot(priv, in.frequency, in.delsys);
+		in.used = priv->chan_clock;
+		*ch = in;
+	}
+	mutex_unlock(&priv->mutex);
+
+	kfree(buf);
+	return ret;
+}
+
+static const struct file_operations avl6381_chans_fops = {
+	.owner		= THIS_MODULE,
+	.open		= avl6381_chans_open,
+	.read		= seq_read,
+	.write		= avl6381_chans_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void avl6381_debugfs_init(struct avl6381_priv *priv)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "avl6381-%d-%02x",
+			priv->i2c->nr, priv->config->demod_address);
+	priv->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("stats", 0444, priv->debugfs, priv,
+			&avl6381_stats_fops);
+	debugfs_create_file("waits", 0444, priv->debugfs, priv,
+			&avl6381_waits_fops);
+	debugfs_create_file("channels", 0644, priv->debugfs, priv,
+			&avl6381_chans_fops);
+}
+
 static void avl6381_release(struct dvb_frontend *fe)
 {
 	struct avl6381_priv *priv = fe->demodulator_priv;
+	cancel_work_sync(&priv->init_work);
+	avl6381_stats_stop(priv);
+	debugfs_remove_recursive(priv->debugfs);
+	avl6381_patch_put(priv);
 	mutex_destroy(&priv->mutex);
 	kfree(priv);
 	return;
@@ -1565,12 +2736,61 @@ static struct dvb_frontend_ops avl6381_ops = {
 	.release					= avl6381_release,
 	.init							= avl6381_init,
 //	.sleep					= avl6381_set_sleep,
+	.sleep						= avl6381_sleep,
 	.i2c_gate_ctrl		= avl6381_i2c_gate_ctrl,
 	.read_status			= avl6381_read_status,
-//	.get_frontend_algo		= avl6862fe_algo,
+	.get_frontend_algo		= avl6381_get_frontend_algo,
+	.tune							= avl6381_tune_step,
 	.set_frontend			= avl6381_set_frontend,
+	.get_frontend			= avl6381_get_frontend,
 };
 
+/*
+ * Detect the tuner before the frontend can be opened: its first init
+ * resets the chip and checks its id, through the gate, which nothing
+ * else may use meanwhile. The tuner is attached right after the demod;
+ * should it not be yet, it probes on the first open instead. Called
+ * locked.
+ */
+static void avl6381_tuner_probe(struct avl6381_priv *priv)
+{
+	struct dvb_frontend *fe = &priv->frontend;
+	int (*init)(struct dvb_frontend *fe);
+	int ret;
+
+	init = READ_ONCE(fe->ops.tuner_ops.init);
+	if (!init)
+		return;
+
+	avl6381_i2c_gate_ctrl(fe, 1);
+	ret = init(fe);
+	avl6381_i2c_gate_ctrl(fe, 0);
+	if (ret)
+		dev_err(&priv->i2c->dev, "%s: tuner init failed (%d)",
+				KBUILD_MODNAME, ret);
+}
+
+/*
+ * The patch upload is most of a probe. Run it here so the adapter can
+ * register at once and several dongles load their patches in parallel.
+ */
+static void avl6381_init_work(struct work_struct *work)
+{
+	struct avl6381_priv *priv = container_of(work, struct avl6381_priv,
+					init_work);
+	int ret;
+
+	mutex_lock(&priv->mutex);
+	ret = AVL6381_Initialize(priv);
+	if (!ret)
+		avl6381_tuner_probe(priv);
+	mutex_unlock(&priv->mutex);
+	if (ret)
+		dev_err(&priv->i2c->dev, "%s: init failed (%d), retrying on open",
+				KBUILD_MODNAME, ret);
+	complete_all(&priv->init_done);
+}
+
 struct dvb_frontend *avl6381_attach(struct avl6381_config *config,
 					struct i2c_adapter *i2c)
 {
@@ -1590,6 +2810,11 @@ struct dvb_frontend *avl6381_attach(struct avl6381_config *config,
 	priv->i2c = i2c;
 	priv->delivery_system = -1;
 	priv->inited = 0;
+	mutex_init(&priv->mutex);
+	seqlock_init(&priv->stats_lock);
+	INIT_DELAYED_WORK(&priv->stats_work, avl6381_stats_work);
+	INIT_WORK(&priv->init_work, avl6381_init_work);
+	init_completion(&priv->init_done);
 
 		if (ret) {
 			dev_err(&priv->i2c->dev, "%s: attach failed reading id",
@@ -1630,7 +2855,8 @@ struct dvb_frontend *avl6381_attach(struct avl6381_config *config,
 	dev_info(&priv->i2c->dev, "%s: found AVL%d " \
 				"family_id=0x%x", KBUILD_MODNAME, id, fid);
 
-	ret = AVL6381_Initialize(priv);
+	queue_work(system_unbound_wq, &priv->init_work);
+	avl6381_debugfs_init(priv);
 
   return &priv->frontend;
 	
@@ -1645,3 +2871,4 @@ EXPORT_SYMBOL_GPL(avl6381_attach);
 MODULE_DESCRIPTION("Availink avl6381 DVB demodulator driver");
 MODULE_AUTHOR("Xiaodong Ni <nxiaodong520@gmail.com>");
 MODULE_LICENSE("GPL");
+MODULE_FIRMWARE(AVL6381_PATCH_FW);
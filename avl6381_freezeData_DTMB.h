@@ -1,4 +1,4 @@
-u8 AVL6381_freezeData_DTMB[] =
+static const u8 AVL6381_freezeData_DTMB[] =
 {
   0x01, 0x01, 0x65, 0xE3, 0x00, 0x00, 0x00, 0xE4, 0x00, 0x2D, 
   0x00, 0x04, 0x00, 0xC1, 0x00, 0x00, 0x00, 0xC2, 0x00, 0x00, 
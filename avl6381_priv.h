@@ -18,11 +18,136 @@
 //#include "avl6381_FwData_DVBC.h"
 //#include "avl6381_patch_dtmb.h"
 //#include "avl6381_freezedata_fw.h"
-#include "avl6381_freezeData_DTMB.h"
+
+#define AVL6381_PATCH_FW "dvb-fe-avl6381-dtmb.fw"
 
 #define MAX_II2C_READ_SIZE  32
 #define MAX_II2C_WRITE_SIZE 32
 
+/* register writes queued between avl6381_batch_begin/end */
+#define AVL6381_BATCH_MAX_MSGS  16
+#define AVL6381_BATCH_BUF_SIZE  (AVL6381_BATCH_MAX_MSGS * MAX_II2C_WRITE_SIZE)
+
+struct avl6381_batch {
+	int depth;		/* nesting level, flushed when it drops to 0 */
+	int nmsgs;
+	int len;		/* bytes of buf in use */
+	u32 next_addr;		/* register following the last queued byte */
+	int ret;		/* first flush error since the outermost begin */
+	struct i2c_msg msgs[AVL6381_BATCH_MAX_MSGS];
+	u8 buf[AVL6381_BATCH_BUF_SIZE];
+};
+
+/* shadow of configuration registers, see avl6381_volatile_regs[] */
+#define AVL6381_REGCACHE_SIZE   128
+
+struct avl6381_regcache_entry {
+	u32 addr;
+	u32 val;
+	int size;		/* 0 marks a free slot */
+};
+
+/*
+ * DTMB patch, parsed once and shared by every attached demod. A device
+ * holds a reference only while it may still have to upload it.
+ */
+struct avl6381_patch_seg {
+	u32 addr;
+	u32 len;
+	const u8 *data;
+};
+
+struct avl6381_patch {
+	struct kref kref;
+	const struct firmware *fw;	/* NULL for the built-in copy */
+	int nsegs;
+	struct avl6381_patch_seg seg[];
+};
+
+/* bytes sampled from each patch segment to recognise a running patch */
+#define AVL6381_PATCH_FP_MAX	16
+#define AVL6381_PATCH_FP_LEN	8
+
+struct avl6381_patch_fp {
+	u32 addr;
+	int len;
+	u8 data[AVL6381_PATCH_FP_LEN];
+};
+
+/*
+ * What the last lock on a frequency used, tried first on the next tune
+ * that leaves the parameter on auto. Slots with frequency 0 are free.
+ */
+#define AVL6381_CHAN_CACHE_SIZE	64
+
+struct avl6381_chan {
+	u32 frequency;
+	u32 delsys;
+	u32 symbol_rate;	/* DVB-C, 0 when it was searched for */
+	u32 pola;		/* DTMB_SetSpectrumPola_6381 argument */
+	u32 lock_us;		/* tune to lock */
+	u32 used;		/* chan_clock at the last tune, for eviction */
+};
+
+/* published by the stats collector, copied by read_status */
+struct avl6381_snapshot {
+	enum fe_status status;
+	u16 strength;		/* as returned by the tuner's get_rf_strength */
+	u32 snr;
+	u32 ber_err;		/* 0x149110 */
+	u32 ber_cnt;		/* 0x149114 */
+};
+
+/* status reported for a locked channel */
+#define AVL6381_FE_LOCKED	(FE_HAS_SYNC | FE_HAS_LOCK)
+
+/* samples with an unchanged lock before the collector slows down */
+#define AVL6381_STATS_SETTLE	5
+
+/* how long an acquire op may take to lock a channel that is there */
+#define AVL6381_LOCK_MS_DVBC	600
+#define AVL6381_LOCK_MS_DTMB	1200
+
+/* acquisition steps taken by avl6381_tune_step */
+enum avl6381_scan_state {
+	AVL6381_SCAN_TUNE,
+	AVL6381_SCAN_PROBE,	/* looking for a reason to give up early */
+	AVL6381_SCAN_WAIT_LOCK,	/* promising channel, wait for lock */
+	AVL6381_SCAN_LOCKED,
+	AVL6381_SCAN_EMPTY,
+};
+
+/* lock-loss watchdog, run from the stats collector */
+enum avl6381_wd_stage {
+	AVL6381_WD_IDLE,	/* tuned, waiting for the first lock */
+	AVL6381_WD_ARMED,	/* locked, watching */
+	AVL6381_WD_HALT,	/* lock lost, halting the demod */
+	AVL6381_WD_REACQUIRE,	/* demod re-acquiring on its own */
+	AVL6381_WD_RETUNE,	/* that failed, full retunes */
+};
+
+/* things avl6381_wait() polls for, each with its own histogram */
+enum avl6381_wait_op {
+	AVL6381_WAIT_RXOP,	/* RX op command register back to idle */
+	AVL6381_WAIT_READY,	/* chip ready signature */
+	AVL6381_WAIT_HALT,	/* running level down after a halt */
+	AVL6381_WAIT_NR,
+};
+
+/* bucket n counts waits of less than 2^n us, the last one everything else */
+#define AVL6381_WAIT_BUCKETS	24
+
+struct avl6381_wait_stats {
+	u32 hist[AVL6381_WAIT_BUCKETS];
+	u32 timeouts;
+};
+
+struct avl6381_reg {
+	u32 addr;
+	int size;
+	u32 val;
+};
+
 struct avl6381_priv {
 	struct i2c_adapter *i2c;
  	struct avl6381_config *config;
@@ -31,6 +156,72 @@ struct avl6381_priv {
 	int inited;
 	struct mutex mutex;
 	u16 g_nChannel_ts_total;
+
+	struct avl6381_batch batch;
+	int no_multi_msg;	/* adapter rejects multi-message transfers */
+	u32 i2c_xfers;		/* i2c_transfer calls issued so far */
+
+	struct avl6381_regcache_entry regcache[AVL6381_REGCACHE_SIZE];
+	u32 reg_wr_skips;	/* writes dropped, value already in the chip */
+	u32 reg_rd_hits;	/* reads served from the shadow */
+	u32 tune_xfers;		/* transactions of the last set_frontend */
+	ktime_t tune_start;	/* when the last set_frontend began */
+	int lock_pending;	/* first lock after it not reported yet */
+	u32 patch_bytes;	/* size of the last patch upload */
+	u32 patch_xfers;	/* transactions it took */
+	s64 patch_us;		/* and how long */
+	struct avl6381_patch *patch;	/* held until the first good init */
+	struct avl6381_patch_fp patch_fp[AVL6381_PATCH_FP_MAX];
+	int patch_fp_n;
+	u32 warm_starts;	/* inits that found the patch already running */
+
+	const u8 *pll_conf;	/* PLL entry programmed since the core reset */
+	int sdram_inited;	/* SDRAM set up since the core reset */
+	u32 switches[2];	/* mode switches into MODE_DTMB, MODE_DVBC */
+	s64 switch_us[2];	/* and how long the last one took */
+	struct avl6381_wait_stats waits[AVL6381_WAIT_NR];
+
+	enum avl6381_scan_state scan_state;
+	ktime_t scan_start;
+	ktime_t scan_deadline;	/* end of PROBE or WAIT_LOCK */
+	u32 scan_locked;	/* tunes that ended in lock */
+	u32 scan_empty;		/* and those that did not */
+	u32 scan_early_empty;	/* of those, found empty by the indicators */
+	int fixed;		/* last lock used the caller's symbol rate */
+	u32 fixed_locks;	/* tunes locked that way */
+	u32 fixed_fallbacks;	/* and those that had to search after all */
+
+	struct avl6381_chan chans[AVL6381_CHAN_CACHE_SIZE];
+	struct avl6381_chan learn;	/* parameters of the running tune */
+	int learn_pending;	/* learn not stored yet */
+	u32 chan_clock;
+	u32 chan_hits;		/* tunes that took parameters from chans */
+	u32 retunes_skipped;	/* set_frontend calls for the locked channel */
+
+	enum avl6381_wd_stage wd_stage;
+	ktime_t wd_deadline;	/* end of the current wd_stage attempt */
+	int wd_retune;		/* retune for avl6381_tune_step to do */
+	ktime_t outage_start;
+	u32 outages;		/* lock losses seen by the watchdog */
+	u32 outage_reacquired;	/* ended by the demod-only reacquire */
+	u32 outage_retuned;	/* ended by a full retune */
+	s64 outage_last_us;
+	s64 outage_max_us;
+	s64 outage_total_us;
+
+	struct delayed_work stats_work;
+	seqlock_t stats_lock;	/* protects snap and learn */
+	struct avl6381_snapshot snap;
+	int stats_active;	/* frontend is open, collector rearms itself */
+	int stats_stable;	/* consecutive samples with the same status */
+	u32 stats_samples;
+	/* tuner_ops.sleep before avl6381_tuner_sleep took its place */
+	int (*tuner_sleep)(struct dvb_frontend *fe);
+
+	struct work_struct init_work;	/* first AVL6381_Initialize */
+	struct completion init_done;	/* and its end */
+
+	struct dentry *debugfs;
 };
 
 #endif
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Availink avl6381 demod driver tracepoints
+ *
+ * Copyright (C) 2024 Xiaodong Ni <nxiaodong520@gmail.com>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM avl6381
+
+#if !defined(_AVL6381_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AVL6381_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* steps of avl6381_set_frontend */
+#define AVL6381_PHASE_SELECT_INPUT	0
+#define AVL6381_PHASE_SET_MODE		1
+#define AVL6381_PHASE_TUNER		2
+#define AVL6381_PHASE_PARAMS		3
+#define AVL6381_PHASE_AUTOLOCK		4
+
+#define show_avl6381_phase(phase)					\
+	__print_symbolic(phase,						\
+		{ AVL6381_PHASE_SELECT_INPUT,	"select_input" },	\
+		{ AVL6381_PHASE_SET_MODE,	"set_mode" },		\
+		{ AVL6381_PHASE_TUNER,		"tuner" },		\
+		{ AVL6381_PHASE_PARAMS,		"params" },		\
+		{ AVL6381_PHASE_AUTOLOCK,	"autolock" })
+
+TRACE_EVENT(avl6381_tune_phase,
+	TP_PROTO(int bus, u8 addr, int phase, s64 us, int ret),
+	TP_ARGS(bus, addr, phase, us, ret),
+
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(u8, addr)
+		__field(int, phase)
+		__field(s64, us)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->bus = bus;
+		__entry->addr = addr;
+		__entry->phase = phase;
+		__entry->us = us;
+		__entry->ret = ret;
+	),
+
+	TP_printk("i2c-%d-%02x %s %lld us ret=%d",
+		__entry->bus, __entry->addr,
+		show_avl6381_phase(__entry->phase),
+		__entry->us, __entry->ret)
+);
+
+/* time from the start of set_frontend to the first locked status */
+TRACE_EVENT(avl6381_first_lock,
+	TP_PROTO(int bus, u8 addr, u32 frequency, s64 us),
+	TP_ARGS(bus, addr, frequency, us),
+
+	TP_STRUCT__entry(
+		__field(int, bus)
+		__field(u8, addr)
+		__field(u32, frequency)
+		__field(s64, us)
+	),
+
+	TP_fast_assign(
+		__entry->bus = bus;
+		__entry->addr = addr;
+		__entry->frequency = frequency;
+		__entry->us = us;
+	),
+
+	TP_printk("i2c-%d-%02x %u Hz locked after %lld us",
+		__entry->bus, __entry->addr,
+		__entry->frequency, __entry->us)
+);
+
+#endif /* _AVL6381_TRACE_H */
+
+/* out of tree: the header sits next to the driver sources */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE avl6381_trace
+#include <trace/define_trace.h>
@@ -8,16 +8,20 @@
 #include <linux/version.h>
 #include "it930x.h"
 
+#define CREATE_TRACE_POINTS
+#include "it930x_trace.h"
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 18, 0)
 #define USB_PID_ITETECH_IT9303				0x9306
 #endif
 
-static struct avl6381_config avl6381cfg = {
+/* templates, each device attaches with its own copy in struct state */
+static const struct avl6381_config avl6381cfg = {
 	.demod_address = 0x14,
 	.tuner_address = 0x60,
 };
 
-static struct mxl603_config mxl608cfg = {
+static const struct mxl603_config mxl608cfg = {
 	.singleSupply_3_3V = MXL_ENABLE,
 	.xtalCfg.xtalFreqSel = MXL603_XTAL_24MHz,
 	.xtalCfg.xtalCap = 12,
@@ -49,9 +53,20 @@ static struct mxl603_config mxl608cfg = {
  */
 #define I2C_SPEED_366K 7
 
+static bool pid_filter = 1;
+module_param(pid_filter, bool, 0644);
+MODULE_PARM_DESC(pid_filter, "filter PIDs in the bridge, 0 always passes the full TS");
+
 /* Max transfer size done by I2C transfer functions */
 #define MAX_XFER_SIZE  64
 
+/*
+ * Largest I2C write payload. A control message would have room for
+ * BUF_LEN - 11 bytes, but the limit of the firmware's I2C engine is not
+ * documented, so stay at the size the driver has always accepted.
+ */
+#define IT930X_I2C_MAX_WR_LEN  MAX_XFER_SIZE
+
 DVB_DEFINE_MOD_OPT_ADAPTER_NR(adapter_nr);
 
 static u16 it930x_checksum(const u8 *buf, size_t len)
@@ -70,93 +85,528 @@ static u16 it930x_checksum(const u8 *buf, size_t len)
 	return checksum;
 }
 
-static int it930x_ctrl_msg(struct dvb_usb_device *d, struct usb_req *req)
-{
 #define REQ_HDR_LEN 4 /* send header size */
 #define ACK_HDR_LEN 3 /* rece header size */
 #define CHECKSUM_LEN 2
 #define USB_TIMEOUT 2000
+
+/* a group of control messages waited for together */
+struct it930x_ctrl_batch {
+	atomic_t pending;
+	int ret;	/* first error */
+	struct completion done;
+};
+
+static void it930x_ctrl_batch_init(struct it930x_ctrl_batch *b)
+{
+	atomic_set(&b->pending, 1);
+	b->ret = 0;
+	init_completion(&b->done);
+}
+
+static void it930x_ctrl_batch_cb(void *priv, int ret)
+{
+	struct it930x_ctrl_batch *b = priv;
+
+	if (ret && !b->ret)
+		b->ret = ret;
+	if (atomic_dec_and_test(&b->pending))
+		complete(&b->done);
+}
+
+#define IT930X_WAIT_TX	BIT(0)	/* request URB not completed */
+#define IT930X_WAIT_RX	BIT(1)	/* reply not delivered */
+
+/* devres action: the URBs and buffers behind the channel */
+static void it930x_ctrl_release(void *data)
+{
+	struct it930x_ctrl *ctrl = data;
+	int i;
+
+	usb_kill_anchored_urbs(&ctrl->anchor);
+	for (i = 0; i < IT930X_CTRL_DEPTH; i++) {
+		usb_free_urb(ctrl->slot[i].tx_urb);
+		kfree(ctrl->slot[i].tx_buf);
+	}
+	usb_free_urb(ctrl->rd_urb);
+	kfree(ctrl->rd_buf);
+}
+
+/* URBs and DMA buffers for the control channel, done on first use */
+static int it930x_ctrl_setup(struct dvb_usb_device *d)
+{
 	struct state *state = d_to_priv(d);
-	int ret, wlen, rlen;
-	u16 checksum, tmp_checksum;
+	struct device *dev = &d->intf->dev;
+	struct it930x_ctrl *ctrl;
+	struct it930x_ctrl_slot *slot;
+	int i;
+
+	ctrl = devm_kzalloc(dev, sizeof(*ctrl), GFP_KERNEL);
+	if (!ctrl)
+		return -ENOMEM;
+	if (devm_add_action(dev, it930x_ctrl_release, ctrl)) {
+		devm_kfree(dev, ctrl);
+		return -ENOMEM;
+	}
 
-	mutex_lock(&d->usb_mutex);
+	ctrl->d = d;
+	sema_init(&ctrl->sem, IT930X_CTRL_DEPTH);
+	init_usb_anchor(&ctrl->anchor);
+	spin_lock_init(&ctrl->lock);
+	INIT_LIST_HEAD(&ctrl->fifo);
+	for (i = 0; i < IT930X_CTRL_DEPTH; i++) {
+		slot = &ctrl->slot[i];
+		slot->d = d;
+		slot->ctrl = ctrl;
+		INIT_LIST_HEAD(&slot->node);
+		slot->tx_urb = usb_alloc_urb(0, GFP_KERNEL);
+		slot->tx_buf = kmalloc(BUF_LEN, GFP_KERNEL);
+		if (!slot->tx_urb || !slot->tx_buf)
+			return -ENOMEM;
+	}
+	ctrl->rd_urb = usb_alloc_urb(0, GFP_KERNEL);
+	ctrl->rd_buf = kmalloc(BUF_LEN, GFP_KERNEL);
+	if (!ctrl->rd_urb || !ctrl->rd_buf)
+		return -ENOMEM;
+
+	state->ctrl = ctrl;
+	return 0;
+}
+
+/* report a slot that is done on both sides and free it */
+static void it930x_ctrl_finish(struct it930x_ctrl_slot *slot)
+{
+	struct it930x_ctrl *ctrl = slot->ctrl;
+
+	trace_it930x_ctrl_msg(slot->d->udev->devnum, slot->cmd, slot->seq,
+			slot->wlen, slot->rlen,
+			ktime_us_delta(ktime_get(), slot->start), slot->status);
+	slot->cb(slot->cb_priv, slot->status);
+	clear_bit(slot - ctrl->slot, &ctrl->busy);
+	up(&ctrl->sem);
+}
+
+/* finish what the lock holder collected on done */
+static void it930x_ctrl_complete(struct list_head *done)
+{
+	struct it930x_ctrl_slot *slot, *tmp;
+
+	list_for_each_entry_safe(slot, tmp, done, node) {
+		list_del_init(&slot->node);
+		it930x_ctrl_finish(slot);
+	}
+}
+
+/* the slot stops waiting for bit, queue it on done once idle */
+static void it930x_ctrl_clear(struct it930x_ctrl_slot *slot,
+		unsigned int bit, struct list_head *done)
+{
+	slot->wait &= ~bit;
+	if (!slot->wait)
+		list_add_tail(&slot->node, done);
+}
+
+/* no reply (any more) for this slot, called with ctrl->lock held */
+static void it930x_ctrl_rx_end(struct it930x_ctrl_slot *slot, int ret,
+		struct list_head *done)
+{
+	list_del_init(&slot->node);
+	if (ret && !slot->status)
+		slot->status = ret;
+	it930x_ctrl_clear(slot, IT930X_WAIT_RX, done);
+}
+
+/* hand a checked reply to its slot, called with ctrl->lock held */
+static void it930x_ctrl_reply(struct it930x_ctrl_slot *slot, u8 *buf,
+		int len, struct list_head *done)
+{
+	struct dvb_usb_device *d = slot->d;
+	int ret = 0;
+
+	if (len != ACK_HDR_LEN + slot->rlen + CHECKSUM_LEN) {
+		dev_err(&d->udev->dev, "command=%02x reply of %d bytes, expected %d\n",
+			slot->cmd, len, ACK_HDR_LEN + slot->rlen + CHECKSUM_LEN);
+		ret = -EIO;
+	} else if (buf[2]) {
+		/* fw returns status 1 when IR code was not received */
+		if (slot->cmd == CMD_IR_GET || buf[2] == 1) {
+			ret = 1;
+		} else {
+			dev_dbg(&d->udev->dev, "command=%02x failed fw error=%d\n",
+				slot->cmd, buf[2]);
+			ret = -EIO;
+		}
+	} else if (slot->rlen) {
+		/* read request, copy returned data to return buf */
+		memcpy(slot->rbuf, &buf[ACK_HDR_LEN], slot->rlen);
+	}
+	it930x_ctrl_rx_end(slot, ret, done);
+}
+
+static void it930x_ctrl_rd_done(struct urb *urb);
+
+/*
+ * Start reading the reply of the oldest slot still waiting for one,
+ * unless a read is already running. Called with ctrl->lock held.
+ */
+static void it930x_ctrl_read(struct it930x_ctrl *ctrl, struct list_head *done)
+{
+	struct dvb_usb_device *d = ctrl->d;
+	struct it930x_ctrl_slot *slot, *tmp;
+	int ret;
+
+	if (ctrl->rd_busy || list_empty(&ctrl->fifo))
+		return;
+
+	slot = list_first_entry(&ctrl->fifo, struct it930x_ctrl_slot, node);
+	usb_fill_bulk_urb(ctrl->rd_urb, d->udev,
+			usb_rcvbulkpipe(d->udev,
+				d->props->generic_bulk_ctrl_endpoint_response),
+			ctrl->rd_buf, ACK_HDR_LEN + slot->rlen + CHECKSUM_LEN,
+			it930x_ctrl_rd_done, ctrl);
+	usb_anchor_urb(ctrl->rd_urb, &ctrl->anchor);
+	ret = usb_submit_urb(ctrl->rd_urb, GFP_ATOMIC);
+	if (!ret) {
+		ctrl->rd_busy = true;
+		return;
+	}
+
+	/* nothing is going to read their replies */
+	usb_unanchor_urb(ctrl->rd_urb);
+	list_for_each_entry_safe(slot, tmp, &ctrl->fifo, node)
+		it930x_ctrl_rx_end(slot, ret, done);
+}
+
+/*
+ * One reply came in. Replies arrive in request order, so it belongs to
+ * the slot whose sequence number it carries, and slots queued in front
+ * of that one have lost theirs. A reply nobody is waiting for (a late
+ * answer to a request given up on, or a broken one) is dropped and the
+ * next one is read, so the channel resyncs by itself.
+ */
+static void it930x_ctrl_rd_done(struct urb *urb)
+{
+	struct it930x_ctrl *ctrl = urb->context;
+	struct dvb_usb_device *d = ctrl->d;
+	struct it930x_ctrl_slot *slot = NULL, *tmp, *n;
+	u8 *buf = ctrl->rd_buf;
+	int len = urb->actual_length;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	ctrl->rd_busy = false;
+
+	/* killed, unplugged or stalled: give up on everything queued */
+	if (urb->status && urb->status != -EOVERFLOW) {
+		list_for_each_entry_safe(tmp, n, &ctrl->fifo, node)
+			it930x_ctrl_rx_end(tmp, urb->status, &done);
+		goto unlock;
+	}
+
+	if (!urb->status && len >= ACK_HDR_LEN + CHECKSUM_LEN &&
+			it930x_checksum(buf, len - 2) ==
+			((buf[len - 2] << 8) | buf[len - 1])) {
+		list_for_each_entry(tmp, &ctrl->fifo, node)
+			if (tmp->seq == buf[1]) {
+				slot = tmp;
+				break;
+			}
+	}
+
+	if (!slot) {
+		ctrl->stale++;
+		dev_dbg(&d->udev->dev, "dropped reply seq=%u len=%d status=%d\n",
+			len ? buf[1] : 0, len, urb->status);
+	} else {
+		list_for_each_entry_safe(tmp, n, &ctrl->fifo, node) {
+			if (tmp == slot)
+				break;
+			dev_err(&d->udev->dev, "command=%02x seq=%u reply lost\n",
+				tmp->cmd, tmp->seq);
+			it930x_ctrl_rx_end(tmp, -EIO, &done);
+		}
+		it930x_ctrl_reply(slot, buf, len, &done);
+	}
+	it930x_ctrl_read(ctrl, &done);
+unlock:
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+	it930x_ctrl_complete(&done);
+}
+
+static void it930x_ctrl_tx_done(struct urb *urb)
+{
+	struct it930x_ctrl_slot *slot = urb->context;
+	struct it930x_ctrl *ctrl = slot->ctrl;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&ctrl->lock, flags);
+	if (urb->status) {
+		if (!slot->status)
+			slot->status = urb->status;
+		/* no request, no reply to wait for */
+		if (slot->wait & IT930X_WAIT_RX)
+			it930x_ctrl_rx_end(slot, urb->status, &done);
+	}
+	it930x_ctrl_clear(slot, IT930X_WAIT_TX, &done);
+	spin_unlock_irqrestore(&ctrl->lock, flags);
+	it930x_ctrl_complete(&done);
+}
+
+/*
+ * Queue a control message and return; cb gets the result. Requests go
+ * out under usb_mutex, so the bridge sees them, and answers them, in
+ * sequence number order. wbuf and dbuf may be reused on return, rbuf has
+ * to stay valid until cb.
+ */
+static int it930x_ctrl_submit(struct dvb_usb_device *d, struct usb_req *req,
+		it930x_ctrl_cb cb, void *cb_priv)
+{
+	struct state *state = d_to_priv(d);
+	struct it930x_ctrl *ctrl;
+	struct it930x_ctrl_slot *slot = NULL;
+	unsigned long flags;
+	int ret = 0, i, wlen;
+	u16 checksum;
+	u8 *buf;
+	LIST_HEAD(done);
 
 	/* buffer overflow check */
-	if (req->wlen > (BUF_LEN - REQ_HDR_LEN - CHECKSUM_LEN) ||
+	if (req->wlen + req->dlen > (BUF_LEN - REQ_HDR_LEN - CHECKSUM_LEN) ||
 			req->rlen > (BUF_LEN - ACK_HDR_LEN - CHECKSUM_LEN)) {
 		dev_err(&d->udev->dev, "too much data wlen=%d rlen=%d\n",
-			req->wlen, req->rlen);
-		ret = -EINVAL;
+			req->wlen + req->dlen, req->rlen);
+		return -EINVAL;
+	}
+
+	mutex_lock(&d->usb_mutex);
+	if (state->ctrl_dead)
+		ret = -ENODEV;
+	else if (!state->ctrl)
+		ret = it930x_ctrl_setup(d);
+	ctrl = state->ctrl;
+	mutex_unlock(&d->usb_mutex);
+	if (ret)
+		return ret;
+
+	if (down_timeout(&ctrl->sem, msecs_to_jiffies(USB_TIMEOUT)))
+		return -ETIMEDOUT;
+
+	mutex_lock(&d->usb_mutex);
+	if (state->ctrl_dead) {
+		up(&ctrl->sem);
+		ret = -ENODEV;
 		goto exit;
 	}
+	for (i = 0; i < IT930X_CTRL_DEPTH; i++)
+		if (!test_and_set_bit(i, &ctrl->busy)) {
+			slot = &ctrl->slot[i];
+			break;
+		}
 
-	state->buf[0] = REQ_HDR_LEN + req->wlen + CHECKSUM_LEN - 1;
-	state->buf[1] = req->mbox;
-	state->buf[2] = req->cmd;
-	state->buf[3] = state->seq++;
-	memcpy(&state->buf[REQ_HDR_LEN], req->wbuf, req->wlen);
+	buf = slot->tx_buf;
+	buf[0] = REQ_HDR_LEN + req->wlen + req->dlen + CHECKSUM_LEN - 1;
+	buf[1] = req->mbox;
+	buf[2] = req->cmd;
+	buf[3] = slot->seq = state->seq++;
+	state->ctrl_msgs++;
+	memcpy(&buf[REQ_HDR_LEN], req->wbuf, req->wlen);
+	if (req->dlen)
+		memcpy(&buf[REQ_HDR_LEN + req->wlen], req->dbuf, req->dlen);
 
-	wlen = REQ_HDR_LEN + req->wlen + CHECKSUM_LEN;
-	rlen = ACK_HDR_LEN + req->rlen + CHECKSUM_LEN;
+	wlen = REQ_HDR_LEN + req->wlen + req->dlen + CHECKSUM_LEN;
 
 	/* calc and add checksum */
-	checksum = it930x_checksum(state->buf, state->buf[0] - 1);
-	state->buf[state->buf[0] - 1] = (checksum >> 8);
-	state->buf[state->buf[0] - 0] = (checksum & 0xff);
-
+	checksum = it930x_checksum(buf, buf[0] - 1);
+	buf[buf[0] - 1] = (checksum >> 8);
+	buf[buf[0] - 0] = (checksum & 0xff);
+
+	slot->cmd = req->cmd;
+	slot->wlen = req->wlen + req->dlen;
+	slot->rlen = req->rlen;
+	slot->rbuf = req->rbuf;
+	slot->status = 0;
+	slot->cb = cb;
+	slot->cb_priv = cb_priv;
+	slot->start = ktime_get();
 	/* no ack for these packets */
-	if (req->cmd == CMD_FW_DL)
-		rlen = 0;
-	ret = dvb_usbv2_generic_rw_locked(d,
-			state->buf, wlen, state->buf, rlen);
+	slot->wait = IT930X_WAIT_TX;
+	if (req->cmd != CMD_FW_DL)
+		slot->wait |= IT930X_WAIT_RX;
 
-			
-	if (ret)
-		goto exit;
+	usb_fill_bulk_urb(slot->tx_urb, d->udev,
+			usb_sndbulkpipe(d->udev, d->props->generic_bulk_ctrl_endpoint),
+			buf, wlen, it930x_ctrl_tx_done, slot);
+	usb_anchor_urb(slot->tx_urb, &ctrl->anchor);
 
-	/* no ack for those packets */
-	if (req->cmd == CMD_FW_DL)
-		goto exit;
+	/* in the fifo before the bridge can answer */
+	spin_lock_irqsave(&ctrl->lock, flags);
+	if (slot->wait & IT930X_WAIT_RX)
+		list_add_tail(&slot->node, &ctrl->fifo);
+	spin_unlock_irqrestore(&ctrl->lock, flags);
 
-	/* verify checksum */
-	checksum = it930x_checksum(state->buf, rlen - 2);
-	tmp_checksum = (state->buf[rlen - 2] << 8) | state->buf[rlen - 1];
-	if (tmp_checksum != checksum) {
-		dev_err(&d->udev->dev, "command=%02x checksum mismatch (%04x != %04x)\n",
-			req->cmd, tmp_checksum, checksum);
-		ret = -EIO;
-		goto exit;
-	}
+	ret = usb_submit_urb(slot->tx_urb, GFP_KERNEL);
 
-	/* check status */
-	if (state->buf[2]) {
-		/* fw returns status 1 when IR code was not received */
-		if (req->cmd == CMD_IR_GET || state->buf[2] == 1) {
-			ret = 1;
-			goto exit;
-		}
+	spin_lock_irqsave(&ctrl->lock, flags);
+	if (ret)
+		list_del_init(&slot->node);
+	else
+		it930x_ctrl_read(ctrl, &done);
+	spin_unlock_irqrestore(&ctrl->lock, flags);
 
-		dev_dbg(&d->udev->dev, "command=%02x failed fw error=%d\n",
-			req->cmd, state->buf[2]);
-		ret = -EIO;
-		goto exit;
+	if (ret) {
+		usb_unanchor_urb(slot->tx_urb);
+		clear_bit(i, &ctrl->busy);
+		up(&ctrl->sem);
 	}
-
-	/* read request, copy returned data to return buf */
-	if (req->rlen)
-		memcpy(req->rbuf, &state->buf[ACK_HDR_LEN], req->rlen);
 exit:
 	mutex_unlock(&d->usb_mutex);
+	it930x_ctrl_complete(&done);
 	return ret;
 }
 
-/* write multiple registers */
-static int it930x_wr_regs(struct dvb_usb_device *d, u32 reg, u8 *val, int len)
+/*
+ * Give up on the messages of batch b only: their requests are killed and
+ * their replies no longer waited for, one that still turns up is dropped
+ * by the reader. Other callers' messages carry on.
+ */
+static void it930x_ctrl_abandon(struct dvb_usb_device *d,
+		struct it930x_ctrl_batch *b)
+{
+	struct state *state = d_to_priv(d);
+	struct it930x_ctrl *ctrl = state->ctrl;
+	struct it930x_ctrl_slot *slot;
+	unsigned long flags;
+	LIST_HEAD(done);
+	int i;
+
+	/* slots change owner only under usb_mutex */
+	mutex_lock(&d->usb_mutex);
+	for (i = 0; i < IT930X_CTRL_DEPTH; i++) {
+		slot = &ctrl->slot[i];
+		if (!test_bit(i, &ctrl->busy) ||
+				slot->cb != it930x_ctrl_batch_cb || slot->cb_priv != b)
+			continue;
+		usb_kill_urb(slot->tx_urb);
+		spin_lock_irqsave(&ctrl->lock, flags);
+		if (slot->wait & IT930X_WAIT_RX)
+			it930x_ctrl_rx_end(slot, -ETIMEDOUT, &done);
+		spin_unlock_irqrestore(&ctrl->lock, flags);
+	}
+	mutex_unlock(&d->usb_mutex);
+	it930x_ctrl_complete(&done);
+}
+
+/* wait for a batch, giving up on its messages after USB_TIMEOUT */
+static int it930x_ctrl_batch_wait(struct dvb_usb_device *d,
+		struct it930x_ctrl_batch *b)
+{
+	if (atomic_dec_and_test(&b->pending))
+		return b->ret;
+	if (!wait_for_completion_timeout(&b->done,
+			msecs_to_jiffies(USB_TIMEOUT))) {
+		it930x_ctrl_abandon(d, b);
+		wait_for_completion(&b->done);
+		return -ETIMEDOUT;
+	}
+	return b->ret;
+}
+
+/* queue req as part of batch b */
+static int it930x_ctrl_msg_batch(struct dvb_usb_device *d, struct usb_req *req,
+		struct it930x_ctrl_batch *b)
+{
+	int ret;
+
+	atomic_inc(&b->pending);
+	ret = it930x_ctrl_submit(d, req, it930x_ctrl_batch_cb, b);
+	if (ret)
+		it930x_ctrl_batch_cb(b, ret);
+	return ret;
+}
+
+static int it930x_ctrl_msg(struct dvb_usb_device *d, struct usb_req *req)
+{
+	struct it930x_ctrl_batch b;
+
+	it930x_ctrl_batch_init(&b);
+	it930x_ctrl_msg_batch(d, req, &b);
+	return it930x_ctrl_batch_wait(d, &b);
+}
+
+/*
+ * Only registers a table programs get an entry, so the GPIO shadow and
+ * the PID filter cannot evict what bring-up relies on; their writes just
+ * keep an existing entry current. They run from different contexts;
+ * regcache_lock covers every access.
+ */
+static struct it930x_regcache *it930x_regcache_find(struct state *state,
+		u32 reg)
+{
+	int i;
+
+	for (i = 0; i < state->regcache_n; i++)
+		if (state->regcache[i].reg == reg)
+			return &state->regcache[i];
+	return NULL;
+}
+
+/*
+ * Remember what was written to len registers from reg. Registers not
+ * cached yet get an entry only if add is set, the oldest goes when full.
+ */
+static void it930x_regcache_set(struct state *state, u32 reg, const u8 *val,
+		int len, bool add)
+{
+	struct it930x_regcache *rc;
+	int i;
+
+	spin_lock(&state->regcache_lock);
+	for (i = 0; i < len; i++) {
+		rc = it930x_regcache_find(state, reg + i);
+		if (!rc && !add)
+			continue;
+		if (!rc) {
+			if (state->regcache_n < IT930X_REGCACHE_SIZE) {
+				rc = &state->regcache[state->regcache_n++];
+			} else {
+				rc = &state->regcache[state->regcache_next];
+				state->regcache_next = (state->regcache_next + 1) %
+						IT930X_REGCACHE_SIZE;
+			}
+			rc->reg = reg + i;
+		}
+		rc->val = val[i];
+	}
+	spin_unlock(&state->regcache_lock);
+}
+
+/* the last value written to reg, false if it is not cached */
+static bool it930x_regcache_get(struct state *state, u32 reg, u8 *val)
 {
+	struct it930x_regcache *rc;
+
+	spin_lock(&state->regcache_lock);
+	rc = it930x_regcache_find(state, reg);
+	if (rc)
+		*val = rc->val;
+	spin_unlock(&state->regcache_lock);
+	return rc != NULL;
+}
+
+/*
+ * Queue a register write in batch b. The cache is updated as soon as the
+ * write is queued; whoever waits on the batch drops it if the batch fails.
+ */
+static int it930x_wr_regs_batch(struct dvb_usb_device *d, u32 reg, u8 *val,
+		int len, struct it930x_ctrl_batch *b)
+{
+	struct state *state = d_to_priv(d);
 	u8 wbuf[MAX_XFER_SIZE];
 	u8 mbox = (reg >> 16) & 0xff;
 	struct usb_req req = { CMD_MEM_WR, mbox, 6 + len, wbuf, 0, NULL };
+	int ret;
 
 	if (6 + len > sizeof(wbuf)) {
 		dev_warn(&d->udev->dev, "i2c wr: len=%d is too big!\n", len);
@@ -171,7 +621,32 @@ static int it930x_wr_regs(struct dvb_usb_device *d, u32 reg, u8 *val, int len)
 	wbuf[5] = (reg >> 0) & 0xff;
 	memcpy(&wbuf[6], val, len);
 
-	return it930x_ctrl_msg(d, &req);
+	ret = it930x_ctrl_msg_batch(d, &req, b);
+	if (!ret)
+		it930x_regcache_set(state, reg, val, len, false);
+	return ret;
+}
+
+static void it930x_regcache_drop(struct state *state)
+{
+	spin_lock(&state->regcache_lock);
+	state->regcache_n = 0;
+	state->regcache_next = 0;
+	spin_unlock(&state->regcache_lock);
+}
+
+/* write multiple registers */
+static int it930x_wr_regs(struct dvb_usb_device *d, u32 reg, u8 *val, int len)
+{
+	struct it930x_ctrl_batch b;
+	int ret;
+
+	it930x_ctrl_batch_init(&b);
+	it930x_wr_regs_batch(d, reg, val, len, &b);
+	ret = it930x_ctrl_batch_wait(d, &b);
+	if (ret)
+		it930x_regcache_drop(d_to_priv(d));
+	return ret;
 }
 
 /* read multiple registers */
@@ -217,6 +692,89 @@ static int it930x_wr_reg_mask(struct dvb_usb_device *d, u32 reg, u8 val,
 	return it930x_wr_regs(d, reg, &val, 1);
 }
 
+/* queue a run of table values and give its registers cache entries */
+static int it930x_wr_table_run(struct dvb_usb_device *d, u32 reg, u8 *val,
+		int len, struct it930x_ctrl_batch *b)
+{
+	int ret;
+
+	ret = it930x_wr_regs_batch(d, reg, val, len, b);
+	if (!ret)
+		it930x_regcache_set(d_to_priv(d), reg, val, len, true);
+	return ret;
+}
+
+/*
+ * Write a table of registers in order. Masked entries take the bits they
+ * keep from the last value written (one read the first time a register
+ * is seen), and runs of consecutive addresses go out as one CMD_MEM_WR.
+ * An entry with a delay_ms waits for everything up to it to be done,
+ * then sleeps that long before the rest of the table.
+ */
+static int it930x_wr_reg_table(struct dvb_usb_device *d,
+		const struct reg_val_mask *tab, int n)
+{
+	struct state *state = d_to_priv(d);
+	struct it930x_ctrl_batch b;
+	u8 run[MAX_XFER_SIZE - 6];
+	u32 run_reg = 0;
+	int run_len = 0;
+	int ret = 0, i;
+	u8 val, cur;
+
+	/*
+	 * Writes are only queued; the bridge answers in order, so a read
+	 * for a masked entry still sees every write queued before it.
+	 */
+	it930x_ctrl_batch_init(&b);
+	for (i = 0; i < n; i++) {
+		if (run_len && (tab[i].reg != run_reg + run_len ||
+				run_len == sizeof(run))) {
+			ret = it930x_wr_table_run(d, run_reg, run, run_len, &b);
+			if (ret)
+				goto exit;
+			run_len = 0;
+		}
+
+		val = tab[i].val;
+		if (tab[i].mask != 0xff) {
+			if (!it930x_regcache_get(state, tab[i].reg, &cur)) {
+				ret = it930x_rd_reg(d, tab[i].reg, &cur);
+				if (ret)
+					goto exit;
+			}
+			val = (val & tab[i].mask) | (cur & ~tab[i].mask);
+		}
+
+		if (!run_len)
+			run_reg = tab[i].reg;
+		run[run_len++] = val;
+
+		if (!tab[i].delay_ms)
+			continue;
+		ret = it930x_wr_table_run(d, run_reg, run, run_len, &b);
+		if (ret)
+			goto exit;
+		run_len = 0;
+		ret = it930x_ctrl_batch_wait(d, &b);
+		if (ret)
+			goto drop;
+		msleep(tab[i].delay_ms);
+		it930x_ctrl_batch_init(&b);
+	}
+
+	if (run_len)
+		it930x_wr_table_run(d, run_reg, run, run_len, &b);
+exit:
+	i = it930x_ctrl_batch_wait(d, &b);
+	if (!ret)
+		ret = i;
+drop:
+	if (ret)
+		it930x_regcache_drop(state);
+	return ret;
+}
+
 static int it930x_i2c_read(struct dvb_usb_device *d, u8 addr, u8 *val, int len)
 {
 	int ret;
@@ -236,9 +794,9 @@ static int it930x_i2c_read(struct dvb_usb_device *d, u8 addr, u8 *val, int len)
 static int it930x_i2c_write(struct dvb_usb_device *d, u8 addr, u8 *data, int len)
 {
 	int ret;
-	u8 buf[MAX_XFER_SIZE];
-	struct usb_req req = { CMD_GENERIC_I2C_WR, 0, 5+len,
-						data, 0, NULL };
+	u8 buf[3];
+	struct usb_req req = { CMD_GENERIC_I2C_WR, 0, sizeof(buf),
+						buf, 0, NULL, len, data };
 	
 	req.mbox |= ((addr & 0x80)  >>  3);
 	buf[0] = len;
@@ -249,15 +807,17 @@ static int it930x_i2c_write(struct dvb_usb_device *d, u8 addr, u8 *data, int len
 	return ret;
 }
 
-static int it930x_i2c_master_xfer(struct i2c_adapter *adap,
-		struct i2c_msg msg[], int num)
+/*
+ * Queue one I2C transaction on batch b: a write (rd == NULL), a read
+ * (wr == NULL) or a write followed by a repeated start read.
+ */
+static int it930x_i2c_queue(struct dvb_usb_device *d, struct i2c_msg *wr,
+		struct i2c_msg *rd, struct it930x_ctrl_batch *b)
 {
-	struct dvb_usb_device *d = i2c_get_adapdata(adap);
 	struct state *state = d_to_priv(d);
-	int ret;
-
-	if (mutex_lock_interruptible(&d->i2c_mutex) < 0)
-		return -EAGAIN;
+	struct i2c_msg *m = wr ? wr : rd;
+	u8 buf[MAX_XFER_SIZE];
+	struct usb_req req = { CMD_I2C_RD, 0, 5, buf, 0, NULL };
 
 	/*
 	 * AF9035 I2C sub header is 5 bytes long. Meaning of those bytes are:
@@ -294,124 +854,103 @@ static int it930x_i2c_master_xfer(struct i2c_adapter *adap,
 	 * 1: I2C bus (0x03 seems to be only value used)
 	 * 2: I2C addr << 1
 	 */
-#define it930x_IS_I2C_XFER_WRITE_READ(_msg, _num) \
-	(_num == 2 && !(_msg[0].flags & I2C_M_RD) && (_msg[1].flags & I2C_M_RD))
-#define it930x_IS_I2C_XFER_WRITE(_msg, _num) \
-	(_num == 1 && !(_msg[0].flags & I2C_M_RD))
-#define it930x_IS_I2C_XFER_READ(_msg, _num) \
-	(_num == 1 && (_msg[0].flags & I2C_M_RD))
-
-	if (it930x_IS_I2C_XFER_WRITE_READ(msg, num)) {
-		if (msg[0].len > MAX_XFER_SIZE || msg[1].len > MAX_XFER_SIZE) {
+	if (rd) {
+		if (rd->len > MAX_XFER_SIZE || (wr && wr->len > MAX_XFER_SIZE))
 			/* TODO: correct limits > 40 */
-			ret = -EOPNOTSUPP;
-		} else {
-			/* I2C write + read */
-			u8 buf[MAX_XFER_SIZE];
-			struct usb_req req = { CMD_I2C_RD, 0, 5 + msg[0].len,
-					buf, msg[1].len, msg[1].buf };
-
-			if (state->chip_type == 0x9306) {
-				req.cmd = CMD_GENERIC_I2C_RD;
-				req.wlen = 3 + msg[0].len;
-			}
-			req.mbox |= ((msg[0].addr & 0x80)  >>  3);
+			return -EOPNOTSUPP;
+		req.rlen = rd->len;
+		req.rbuf = rd->buf;
+		buf[0] = rd->len;
+	} else {
+		if (wr->len > IT930X_I2C_MAX_WR_LEN)
+			return -EOPNOTSUPP;
+		/*
+		 * I2C write: only the sub header is built here, the payload
+		 * goes straight from wr->buf to the usb buffer
+		 */
+		req.cmd = CMD_I2C_WR;
+		req.dlen = wr->len;
+		req.dbuf = wr->buf;
+		buf[0] = wr->len;
+	}
 
-			buf[0] = msg[1].len;
-			if (state->chip_type == 0x9306) {
-				buf[1] = 0x01; /* I2C bus */
-				buf[2] = msg[0].addr << 1;
-				memcpy(&buf[3], msg[0].buf, msg[0].len);
-			} else {
-				buf[1] = msg[0].addr << 1;
-				buf[3] = 0x00; /* reg addr MSB */
-				buf[4] = 0x00; /* reg addr LSB */
-
-				/* Keep prev behavior for write req len > 2*/
-				if (msg[0].len > 2) {
-					buf[2] = 0x00; /* reg addr len */
-					memcpy(&buf[5], msg[0].buf, msg[0].len);
-
-				/* Use reg addr fields if write req len <= 2 */
-				} else {
-					req.wlen = 5;
-					buf[2] = msg[0].len;
-					if (msg[0].len == 2) {
-						buf[3] = msg[0].buf[0];
-						buf[4] = msg[0].buf[1];
-					} else if (msg[0].len == 1) {
-						buf[4] = msg[0].buf[0];
-					}
-				}
-			}
-			ret = it930x_ctrl_msg(d, &req);
+	req.mbox |= ((m->addr & 0x80)  >>  3);
+	if (state->chip_type == 0x9306) {
+		req.cmd = rd ? CMD_GENERIC_I2C_RD : CMD_GENERIC_I2C_WR;
+		req.wlen = 3;
+		buf[1] = 0x01; /* I2C bus */
+		buf[2] = m->addr << 1;
+		if (wr && rd) {
+			/* the write goes after the 3 byte sub header */
+			if (wr->len > sizeof(buf) - 3)
+				return -EOPNOTSUPP;
+			memcpy(&buf[3], wr->buf, wr->len);
+			req.wlen += wr->len;
 		}
-	} else if (it930x_IS_I2C_XFER_WRITE(msg, num)) {
-		if (msg[0].len > MAX_XFER_SIZE) {
-			/* TODO: correct limits > 40 */
-			ret = -EOPNOTSUPP;
-		} else {
-			/* I2C write */
-			u8 buf[MAX_XFER_SIZE];
-			struct usb_req req = { CMD_I2C_WR, 0, 5 + msg[0].len,
-					buf, 0, NULL };
-
-			if (state->chip_type == 0x9306) {
-				req.cmd = CMD_GENERIC_I2C_WR;
-				req.wlen = 3 + msg[0].len;
-			}
-
-			req.mbox |= ((msg[0].addr & 0x80)  >>  3);
-			buf[0] = msg[0].len;
-			if (state->chip_type == 0x9306) {
-				buf[1] = 0x01; /* I2C bus */
-				buf[2] = msg[0].addr << 1;
-				memcpy(&buf[3], msg[0].buf, msg[0].len);
-			} else {
-				buf[1] = msg[0].addr << 1;
-				buf[2] = 0x00; /* reg addr len */
-				buf[3] = 0x00; /* reg addr MSB */
-				buf[4] = 0x00; /* reg addr LSB */
-				memcpy(&buf[5], msg[0].buf, msg[0].len);
+	} else {
+		buf[1] = m->addr << 1;
+		buf[2] = 0x00; /* reg addr len */
+		buf[3] = 0x00; /* reg addr MSB */
+		buf[4] = 0x00; /* reg addr LSB */
+
+		/* Keep prev behavior for write req len > 2*/
+		if (wr && rd && wr->len > 2) {
+			/* the write goes after the 5 byte sub header */
+			if (wr->len > sizeof(buf) - 5)
+				return -EOPNOTSUPP;
+			memcpy(&buf[5], wr->buf, wr->len);
+			req.wlen += wr->len;
+
+		/* Use reg addr fields if write req len <= 2 */
+		} else if (wr && rd) {
+			buf[2] = wr->len;
+			if (wr->len == 2) {
+				buf[3] = wr->buf[0];
+				buf[4] = wr->buf[1];
+			} else if (wr->len == 1) {
+				buf[4] = wr->buf[0];
 			}
-			ret = it930x_ctrl_msg(d, &req);
 		}
-	} else if (it930x_IS_I2C_XFER_READ(msg, num)) {
-		if (msg[0].len > MAX_XFER_SIZE) {
-			/* TODO: correct limits > 40 */
-			ret = -EOPNOTSUPP;
+	}
+
+	return it930x_ctrl_msg_batch(d, &req, b);
+}
+
+/*
+ * Any number of messages per call. A write directly followed by a read
+ * is one repeated start transaction, everything else is a transaction
+ * of its own. The array is queued without waiting for each ack: the
+ * bridge runs the commands in order, so a read still follows the writes
+ * in front of it. At most IT930X_CTRL_DEPTH commands are in flight,
+ * queueing the next one waits for a free slot, so an n message sequence
+ * costs about n / IT930X_CTRL_DEPTH round trips instead of n. Once
+ * queued, commands behind a failed one still go out; the first error is
+ * returned.
+ */
+static int it930x_i2c_master_xfer(struct i2c_adapter *adap,
+		struct i2c_msg msg[], int num)
+{
+	struct dvb_usb_device *d = i2c_get_adapdata(adap);
+	struct it930x_ctrl_batch b;
+	int ret = 0, i, wret;
+
+	if (mutex_lock_interruptible(&d->i2c_mutex) < 0)
+		return -EAGAIN;
+
+	it930x_ctrl_batch_init(&b);
+	for (i = 0; i < num && !ret; i++) {
+		if (msg[i].flags & I2C_M_RD) {
+			ret = it930x_i2c_queue(d, NULL, &msg[i], &b);
+		} else if (i + 1 < num && (msg[i + 1].flags & I2C_M_RD)) {
+			ret = it930x_i2c_queue(d, &msg[i], &msg[i + 1], &b);
+			i++;
 		} else {
-			/* I2C read */
-			u8 buf[5];
-			struct usb_req req = { CMD_I2C_RD, 0, sizeof(buf),
-						buf, msg[0].len, msg[0].buf };
-
-			if (state->chip_type == 0x9306) {
-				req.cmd = CMD_GENERIC_I2C_RD;
-				req.wlen = 3;
-			}
-			req.mbox |= ((msg[0].addr & 0x80)  >>  3);
-			buf[0] = msg[0].len;
-			if (state->chip_type == 0x9306) {
-				buf[1] = 0x01; /* I2C bus */
-				buf[2] = (msg[0].addr << 1);
-			} else {
-				buf[1] = msg[0].addr << 1;
-				buf[2] = 0x00; /* reg addr len */
-				buf[3] = 0x00; /* reg addr MSB */
-				buf[4] = 0x00; /* reg addr LSB */
-			}
-			ret = it930x_ctrl_msg(d, &req);
+			ret = it930x_i2c_queue(d, &msg[i], NULL, &b);
 		}
-	} else {
-		/*
-		 * We support only three kind of I2C transactions:
-		 * 1) 1 x write + 1 x read (repeated start)
-		 * 2) 1 x write
-		 * 3) 1 x read
-		 */
-		ret = -EOPNOTSUPP;
 	}
+	wret = it930x_ctrl_batch_wait(d, &b);
+	if (!ret)
+		ret = wret;
 
 	mutex_unlock(&d->i2c_mutex);
 
@@ -431,14 +970,84 @@ static struct i2c_algorithm it930x_i2c_algo = {
 	.functionality = it930x_i2c_functionality,
 };
 
-int it930x_set_gpio(struct dvb_usb_device *d, u32 gpio_reg, u8 val) {
-	int ret = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+/* let clients size their bursts to what fits in one control message */
+static const struct i2c_adapter_quirks it930x_i2c_quirks = {
+	.max_write_len = IT930X_I2C_MAX_WR_LEN,
+};
+#endif
 
-	ret = it930x_wr_reg(d, gpio_reg, val);
+/*
+ * Write out the changed bytes of the GPIO shadow, each run of adjacent
+ * registers as one CMD_MEM_WR and all runs as one batch.
+ */
+static int it930x_gpio_flush(struct dvb_usb_device *d)
+{
+	struct state *state = d_to_priv(d);
+	struct it930x_ctrl_batch b;
+	int ret = 0, i, n, r;
+
+	state->gpio_defer = false;
+	if (!state->gpio_dirty)
+		return 0;
+
+	it930x_ctrl_batch_init(&b);
+	for (i = 0; i < IT930X_GPIO_WIN; i += n) {
+		for (n = 0; i + n < IT930X_GPIO_WIN &&
+				n < MAX_XFER_SIZE - 6 &&
+				(state->gpio_dirty & BIT_ULL(i + n)); n++)
+			;
+		if (!n) {
+			n = 1;
+			continue;
+		}
+		r = it930x_wr_regs_batch(d, IT930X_GPIO_BASE + i,
+				&state->gpio_shadow[i], n, &b);
+		if (r && !ret)
+			ret = r;
+	}
+	r = it930x_ctrl_batch_wait(d, &b);
+	if (!ret)
+		ret = r;
 
+	if (ret) {
+		state->gpio_valid &= ~state->gpio_dirty;
+		it930x_regcache_drop(state);
+	} else {
+		state->gpio_valid |= state->gpio_dirty;
+	}
+	state->gpio_dirty = 0;
 	return ret;
 }
 
+/* collect GPIO writes until it930x_gpio_flush */
+static void it930x_gpio_begin(struct dvb_usb_device *d)
+{
+	struct state *state = d_to_priv(d);
+
+	state->gpio_defer = true;
+}
+
+int it930x_set_gpio(struct dvb_usb_device *d, u32 gpio_reg, u8 val) {
+	struct state *state = d_to_priv(d);
+	unsigned int i = gpio_reg - IT930X_GPIO_BASE;
+
+	if (i >= IT930X_GPIO_WIN)
+		return it930x_wr_reg(d, gpio_reg, val);
+
+	/* the pin already is (or is about to be) where we want it */
+	if (((state->gpio_valid | state->gpio_dirty) & BIT_ULL(i)) &&
+			state->gpio_shadow[i] == val)
+		return 0;
+
+	state->gpio_shadow[i] = val;
+	state->gpio_dirty |= BIT_ULL(i);
+	if (state->gpio_defer)
+		return 0;
+
+	return it930x_gpio_flush(d);
+}
+
 int it930x_set_gpio_mode(struct dvb_usb_device *d, enum it930x_gpio gpio, enum it930x_gpio_mode mode)
 {
 	/* GPIO mode registers (gpioh1 to gpioh16) */
@@ -511,14 +1120,11 @@ int it930x_read_gpio(struct dvb_usb_device *d, enum it930x_gpio gpio, bool *high
 	int ret = 0;
 	u8 tmp;
 
-	mutex_lock(&d->usb_mutex);
-
+	/* the control channel takes usb_mutex itself */
 	ret = it930x_rd_reg(d, gpio_i_regs[gpio], &tmp);
 	if (!ret)
 		*high = (tmp) ? true : false;
 
-	mutex_unlock(&d->usb_mutex);
-
 	return ret;
 }
 
@@ -684,6 +1290,7 @@ static int it930x_download_firmware(struct dvb_usb_device *d,
 //	u8 tmp;
 	struct usb_req req = { 0, 0, 0, NULL, 0, NULL };
 	struct usb_req req_fw_ver = { CMD_FW_QUERYINFO, 0, 1, wbuf, 4, rbuf };
+	ktime_t start = ktime_get();
 
 	dev_dbg(&d->udev->dev, "\n");
 
@@ -700,6 +1307,10 @@ static int it930x_download_firmware(struct dvb_usb_device *d,
 	if (ret < 0)
 		goto err;
 
+	/* what identify_state wrote was to the boot loader, read it again */
+	it930x_regcache_drop(state);
+	state->gpio_valid = 0;
+
 	/* ensure firmware starts */
 	wbuf[0] = 1;
 	ret = it930x_ctrl_msg(d, &req_fw_ver);
@@ -714,6 +1325,7 @@ static int it930x_download_firmware(struct dvb_usb_device *d,
 
 	dev_info(&d->udev->dev, "firmware version=%d.%d.%d.%d",
 		 rbuf[0], rbuf[1], rbuf[2], rbuf[3]);
+	state->boot_us[IT930X_BOOT_FIRMWARE] = ktime_us_delta(ktime_get(), start);
 
 	return 0;
 
@@ -728,6 +1340,8 @@ static int it930x_tuner_select_input(struct dvb_frontend *fe, enum fe_delivery_s
   int ret;
   struct dvb_usb_device *d = fe_to_d(fe);
 
+  /* same input as last time: nothing reaches the bus */
+  it930x_gpio_begin(d);
   ret = it930x_set_gpio_mode(d, IT930X_GPIO2, IT930X_GPIO_OUT);
   ret |= it930x_enable_gpio(d, IT930X_GPIO2, IT930X_GPIO_ENABLE);
   ret |= it930x_set_gpio_mode(d, IT930X_GPIO3, IT930X_GPIO_OUT);
@@ -743,10 +1357,21 @@ static int it930x_tuner_select_input(struct dvb_frontend *fe, enum fe_delivery_s
 		ret |= it930x_write_gpio(d, IT930X_GPIO3, IT930X_GPIO_LOW);
     break;
   }
+  ret |= it930x_gpio_flush(d);
 
   return ret;
 }
 
+static const struct reg_val_mask identify_tab[] = {
+	{ 0xda05, 0x01, 0x01 },
+	{ 0x4976, 0x00, 0xff },
+	{ 0x4bfb, 0x00, 0xff },
+	{ 0x4978, 0x00, 0xff },
+	{ 0x4977, 0x00, 0xff },
+	/* I2C master bus 1,3 clock speed 366k */
+	{ 0xf103, I2C_SPEED_366K, 0xff },
+};
+
 static int it930x_identify_state(struct dvb_usb_device *d, const char **name)
 {
 	struct state *state = d_to_priv(d);
@@ -755,14 +1380,20 @@ static int it930x_identify_state(struct dvb_usb_device *d, const char **name)
 	u8 rbuf[4];
 	struct usb_req req = { CMD_FW_QUERYINFO, 0, sizeof(wbuf), wbuf,
 			sizeof(rbuf), rbuf };
+	ktime_t start = ktime_get();
 
-	/* configure gpio1, reset & power slave demod */
+	/* first callback of the probe, before any register access */
+	spin_lock_init(&state->regcache_lock);
+
+	/*
+	 * configure gpio1, reset & power slave demod. The demod gets its
+	 * timed reset pulse in it930x_frontend_attach, the bridge reads
+	 * below do not depend on it.
+	 */
 	ret = it930x_set_gpio_mode(d, IT930X_GPIO1, IT930X_GPIO_OUT);
 	ret |= it930x_enable_gpio(d, IT930X_GPIO1, IT930X_GPIO_ENABLE);
 	ret |= it930x_write_gpio(d, IT930X_GPIO1, IT930X_GPIO_LOW);
 
-	msleep(20);
-	
 	ret = it930x_rd_regs(d, 0x1222, rbuf, 3);
 	if (ret < 0)
 		goto err;
@@ -783,8 +1414,12 @@ static int it930x_identify_state(struct dvb_usb_device *d, const char **name)
 	
 	ret |= it930x_ctrl_msg(d, &req);
 
+	/*
+	 * The waits below come from USB captures. Nothing is known to read
+	 * back when each step is done, so they stay fixed.
+	 */
 	msleep(7);
-	ret |=  it930x_wr_reg_mask(d, 0xda05, 0x01, 0x01);		//check
+	ret |= it930x_wr_reg_table(d, identify_tab, 1);			//check
 	ret |= it930x_write_gpio(d, IT930X_GPIO1, IT930X_GPIO_HIGH);
 	
 	//mp2_sw_rst, reset EP4
@@ -793,17 +1428,13 @@ static int it930x_identify_state(struct dvb_usb_device *d, const char **name)
 	ret |= it930x_wr_reg(d, 0xda1d,  0x00);
 
 	msleep(8);
-	ret |= it930x_wr_reg(d, 0x4976,  0x00);
-	ret |= it930x_wr_reg(d, 0x4bfb,  0x00);
-	ret |= it930x_wr_reg(d, 0x4978,  0x00);
-	ret |= it930x_wr_reg(d, 0x4977,  0x00);
-
-	/* I2C master bus 1,3 clock speed 366k */
-	ret |= it930x_wr_reg(d, 0xf103, I2C_SPEED_366K);
+	ret |= it930x_wr_reg_table(d, &identify_tab[1],
+			ARRAY_SIZE(identify_tab) - 1);
 
 	if (ret)
 		goto err;
 
+	state->boot_us[IT930X_BOOT_IDENTIFY] = ktime_us_delta(ktime_get(), start);
 	dev_info(&d->udev->dev, "reply=%*ph\n", 4, rbuf);
 	if (rbuf[0] || rbuf[1] || rbuf[2] || rbuf[3])
 		ret = WARM;
@@ -820,63 +1451,76 @@ err:
 
 static int it930x_init(struct dvb_usb_device *d)
 {
+	struct state *state = d_to_priv(d);
+	ktime_t start = ktime_get();
 	int ret, i;
 	u8 tmp;
 	u16 frame_size = (d->udev->speed == USB_SPEED_FULL ? 5 : 816) * 188 / 4;
 	u8 packet_size = (d->udev->speed == USB_SPEED_FULL ? 64 : 512) / 4;
-	u8 buf[3];
-
-	/* I2C master bus 2 clock speed 366k */
-	ret = it930x_wr_reg(d, 0xf6a7, I2C_SPEED_366K);
-
-	/* I2C master bus 1,3 clock speed 366k */
-	ret |= it930x_wr_reg(d, 0xf103, I2C_SPEED_366K);
-		
-	/* ignore sync byte: no */
-	ret |= it930x_wr_reg(d, 0xda1a, 0);
-
-	/* dvb-t interrupt: enable */
-	ret |= it930x_wr_reg_mask(d, 0xf41f, 0x04, 0x04);
-
-	/* mpeg full speed */
-	ret |= it930x_wr_reg_mask(d, 0xda10, 0x00, 0x00);
-
-	/* dvb-t mode: enable */
-	ret |= it930x_wr_reg_mask(d, 0xf41a, 0x05, 0x05);		//?
-		
-	ret |= it930x_wr_reg_mask(d, 0xda1d, 0x01, 0x01);
-	
-	/* enable ep4 */
-	ret |= it930x_wr_reg_mask(d, 0xdd11, 0x0F, 0x0F);		//?
-
-	/* disable nak of ep4 */
-	ret |= it930x_wr_reg_mask(d, 0xdd13, 0x1b, 0x1b);		//?
-
-	/* enable ep4 */
-	ret |= it930x_wr_reg_mask(d, 0xdd11, 0x2F, 0x2F);		//?
-
-	buf[0] = (frame_size & 0xff);
-	buf[1] = ((frame_size >> 8) & 0xff);
-	ret |= it930x_wr_regs(d, 0xdd88, buf, 2);
-//	ret |= it930x_wr_reg(d, 0xdd88, (frame_size >> 0) & 0xff);		//check ??
-
-	/* max bulk packet size */
-	ret |= it930x_wr_reg(d, 0xdd0c, packet_size);
-	
-	ret |= it930x_wr_reg_mask(d, 0xda05, 0x00, 0x01);
-	ret |= it930x_wr_reg_mask(d, 0xda06, 0x00, 0x01);
-	ret |= it930x_wr_reg_mask(d, 0xda1d, 0x00, 0x01);
-	
-	/* reverse: no */
-	ret |= it930x_wr_reg(d, 0xd920, 0x00);
-	
-	/* power config ? */
-	ret |= it930x_wr_reg(d, 0xd833, 0x01);
+	const struct reg_val_mask tab[] = {
+		/* I2C master bus 2 clock speed 366k */
+		{ 0xf6a7, I2C_SPEED_366K, 0xff },
+		/* I2C master bus 1,3 clock speed 366k */
+		{ 0xf103, I2C_SPEED_366K, 0xff },
+		/* ignore sync byte: no */
+		{ 0xda1a, 0x00, 0xff },
+		/* dvb-t interrupt: enable */
+		{ 0xf41f, 0x04, 0x04 },
+		/* mpeg full speed */
+		{ 0xda10, 0x00, 0x00 },
+		/* dvb-t mode: enable */
+		{ 0xf41a, 0x05, 0x05 },		//?
+		{ 0xda1d, 0x01, 0x01 },
+		/* enable ep4 */
+		{ 0xdd11, 0x0F, 0x0F },		//?
+		/* disable nak of ep4 */
+		{ 0xdd13, 0x1b, 0x1b },		//?
+		/* enable ep4 */
+		{ 0xdd11, 0x2F, 0x2F },		//?
+		{ 0xdd88, frame_size & 0xff, 0xff },
+		{ 0xdd89, (frame_size >> 8) & 0xff, 0xff },
+		/* max bulk packet size */
+		{ 0xdd0c, packet_size, 0xff },
+		{ 0xda05, 0x00, 0x01 },
+		{ 0xda06, 0x00, 0x01 },
+		{ 0xda1d, 0x00, 0x01 },
+		/* reverse: no */
+		{ 0xd920, 0x00, 0xff },
+		/* power config ? */
+		{ 0xd833, 0x01, 0xff },
+		{ 0xd830, 0x00, 0xff },
+		{ 0xd831, 0x01, 0xff },
+		{ 0xd832, 0x00, 0xff },
+		{ 0x4976, 0x01, 0xff, 20 },
+		/*
+		 * TS engine setup. The waits are as captured, nothing is known
+		 * to read back when a step is done.
+		 */
+		/* ts_in_src, serial */
+		{ 0xda58, 0x00, 0x01, 8 },		//check ??
+		/* in ts pkt len */
+		{ 0xda51, 0x00, 0xff, 8 },
+		/* ts0_aggre_mode */
+		{ 0xda73, 0x01, 0xff },
+		/* ts0_sync_byte */
+		{ 0xda78, 0x47, 0xff, 30 },
+		/* ts0_en */
+		{ 0xda4c, 0x01, 0xff, 8 },
+		/* ts_fail_ignore */
+		{ 0xda5a, 0x1f, 0xff },
+	};
+	u32 msgs = state->ctrl_msgs;
+
+	/* after a reset-resume the bridge lost what we wrote */
+	if (state->inited) {
+		it930x_regcache_drop(state);
+		state->gpio_valid = 0;
+		/* the table is gone, the next feed change reloads it */
+		state->pid_slots = 0;
+		state->pid_resync = true;
+	}
 
-	ret |= it930x_wr_reg(d, 0xd830, 0x00);
-	ret |= it930x_wr_reg(d, 0xd831, 0x01);
-	ret |= it930x_wr_reg(d, 0xd832, 0x00);
-	ret |= it930x_wr_reg(d, 0x4976, 0x01);
+	ret = it930x_wr_reg_table(d, tab, ARRAY_SIZE(tab));
 
 /*	msleep(7);
 	//init it9300  eeprom  //IT9300_cm_init
@@ -901,18 +1545,6 @@ static int it930x_init(struct dvb_usb_device *d)
 	ret |= it930x_write_gpio(d, IT930X_GPIO14, IT930X_GPIO_LOW);
 	ret |= it930x_write_gpio(d, IT930X_GPIO14, IT930X_GPIO_HIGH);*/
 
-	msleep(20);
-	ret |= it930x_wr_reg_mask(d, 0xda58, 0x00, 0x01);	//check ??			//ts_in_src, serial
-	msleep(8);
-	ret |= it930x_wr_reg(d, 0xda51, 0x00);									//in ts pkt len
-	msleep(8);
-	ret |= it930x_wr_reg(d, 0xda73, 0x01);									//ts0_aggre_mode
-	ret |= it930x_wr_reg(d, 0xda78, 0x47);									//ts0_sync_byte
-	msleep(30);
-	ret |= it930x_wr_reg(d, 0xda4c, 0x01);									//ts0_en
-	msleep(8);
-	ret |= it930x_wr_reg(d, 0xda5a, 0x1F);									//ts_fail_ignore
-
 /*	ret |= it930x_rd_reg(d, 0xd800, &tmp);							//rd teststrap regiater //get demod clock
 	ret |= it930x_rd_reg(d, 0xd801, &tmp);							//rd poweron_bootstrap regiater
 	ret |= it930x_rd_reg(d, 0xd802, &tmp);							//rd poweron_hostboot regiater
@@ -944,6 +1576,15 @@ static int it930x_init(struct dvb_usb_device *d)
 	if (ret < 0)
 		goto err;
 
+	state->inited = true;
+	state->boot_us[IT930X_BOOT_INIT] = ktime_us_delta(ktime_get(), start);
+	dev_info(&d->udev->dev, "bring-up: identify %lld us, firmware %lld us, demod reset %lld us, init %lld us (%u round trips, %u since probe)\n",
+			state->boot_us[IT930X_BOOT_IDENTIFY],
+			state->boot_us[IT930X_BOOT_FIRMWARE],
+			state->boot_us[IT930X_BOOT_DEMOD_RESET],
+			state->boot_us[IT930X_BOOT_INIT],
+			state->ctrl_msgs - msgs, state->ctrl_msgs);
+
 	return 0;
 
 err:
@@ -952,22 +1593,84 @@ err:
 	return ret;
 }
 
+/*
+ * Runs on disconnect before the frontend is released, so the demod's
+ * workers may still try to talk: make them fail instead of setting the
+ * channel up again. The memory goes with the interface's resources.
+ */
+static void it930x_exit(struct dvb_usb_device *d)
+{
+	struct state *state = d_to_priv(d);
+
+	mutex_lock(&d->usb_mutex);
+	state->ctrl_dead = true;
+	mutex_unlock(&d->usb_mutex);
+	if (state->ctrl)
+		usb_kill_anchored_urbs(&state->ctrl->anchor);
+}
+
+#define IT930X_DEMOD_RESET_MS	30
+#define IT930X_DEMOD_READY_MS	300
+
+/*
+ * After reset the AVL6381 answers I2C with its family id at 0x040000 once
+ * its boot ROM is up. Read it with two plain messages, the demod does not
+ * take a repeated start.
+ */
+static int it930x_wait_demod(struct dvb_usb_device *d, unsigned int timeout_ms)
+{
+	ktime_t deadline = ktime_add_ms(ktime_get(), timeout_ms);
+	u8 addr[3] = { 0x04, 0x00, 0x00 };
+	u8 id[4];
+	struct i2c_msg msg[2] = {
+		{ .addr = avl6381cfg.demod_address, .flags = 0,
+		  .len = sizeof(addr), .buf = addr },
+		{ .addr = avl6381cfg.demod_address, .flags = I2C_M_RD,
+		  .len = sizeof(id), .buf = id },
+	};
+	unsigned int us = 1000;
+
+	for (;;) {
+		if (i2c_transfer(&d->i2c_adap, &msg[0], 1) == 1 &&
+				i2c_transfer(&d->i2c_adap, &msg[1], 1) == 1 &&
+				(id[0] << 24 | id[1] << 16 | id[2] << 8 | id[3]) ==
+				0x63814e24)
+			return 0;
+		if (ktime_after(ktime_get(), deadline))
+			break;
+		usleep_range(us, us + us / 4);
+		us = min(us * 2, 20000U);
+	}
+
+	return -ETIMEDOUT;
+}
+
 static int it930x_frontend_attach(struct dvb_usb_adapter *adap)
 {
-//	struct state *state = adap_to_priv(adap);
+	struct state *state = adap_to_priv(adap);
 	struct dvb_usb_device *d = adap_to_d(adap);
+	ktime_t start = ktime_get();
 	int ret = 0;
 	
   ret = it930x_set_gpio_mode(d, IT930X_GPIO1, IT930X_GPIO_OUT);
   ret |= it930x_enable_gpio(d, IT930X_GPIO1, IT930X_GPIO_ENABLE);
 	ret |= it930x_write_gpio(d, IT930X_GPIO1, IT930X_GPIO_LOW);
-	msleep(30);
+	/* reset pulse width, no datasheet minimum is known */
+	msleep(IT930X_DEMOD_RESET_MS);
 	ret |= it930x_write_gpio(d, IT930X_GPIO1, IT930X_GPIO_HIGH);
-	msleep(150);
+	/* on timeout let avl6381_attach report what it finds */
+	if (it930x_wait_demod(d, IT930X_DEMOD_READY_MS))
+		dev_dbg(&d->udev->dev, "demod not ready after %u ms\n",
+				IT930X_DEMOD_READY_MS);
+	state->boot_us[IT930X_BOOT_DEMOD_RESET] = ktime_us_delta(ktime_get(), start);
 				 
 	dev_info(&d->udev->dev, "Checking for Availink AVL6381 DVB-S2/T2/C demod ...\n");
-	avl6381cfg.tuner_select_input = it930x_tuner_select_input;
-	adap->fe[0] = dvb_attach(avl6381_attach, &avl6381cfg, &d->i2c_adap);
+	state->avl6381cfg = avl6381cfg;
+	state->avl6381cfg.tuner_select_input = it930x_tuner_select_input;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	d->i2c_adap.quirks = &it930x_i2c_quirks;
+#endif
+	adap->fe[0] = dvb_attach(avl6381_attach, &state->avl6381cfg, &d->i2c_adap);
 	if (adap->fe[0] == NULL)
 	{
 		dev_info(&d->udev->dev, "Failed to find AVL6381 demod!\n");
@@ -985,7 +1688,7 @@ err:
 
 static int it930x_tuner_attach(struct dvb_usb_adapter *adap)
 {
-//	struct state *state = adap_to_priv(adap);
+	struct state *state = adap_to_priv(adap);
 	struct dvb_usb_device *d = adap_to_d(adap);
 	struct dvb_frontend *fe = NULL;
 	int ret;
@@ -993,7 +1696,8 @@ static int it930x_tuner_attach(struct dvb_usb_adapter *adap)
 
 	dev_dbg(&d->udev->dev, "adap->id=%d\n", adap->id);
 
-	fe = dvb_attach(mxl603_attach, adap->fe[0], &d->i2c_adap, avl6381cfg.tuner_address, &mxl608cfg);
+	state->mxl603cfg = mxl608cfg;
+	fe = dvb_attach(mxl603_attach, adap->fe[0], &d->i2c_adap, state->avl6381cfg.tuner_address, &state->mxl603cfg);
 	if (fe == NULL)
 	{
 		ret = -ENODEV;
@@ -1021,78 +1725,162 @@ static int it930x_get_stream_config(struct dvb_frontend *fe, u8 *ts_type,
 	return 0;
 }
 
+/* TS port 0; the other ports have their own remap mode and index regs */
+#define IT930X_PID_REMAP_MODE	0xda13	/* 0 pass all, 2 pass listed */
+#define IT930X_PID_ENABLE	0xda14
+#define IT930X_PID_INDEX	0xda15	/* written last, latches the entry */
+#define IT930X_PID_VALUE	0xda16
+
+static bool it930x_pid_is_on(struct state *state, u16 pid)
+{
+	int i;
+
+	for (i = 0; i < IT930X_PID_FEEDS; i++)
+		if (test_bit(i, state->feed_on) && state->feed_pid[i] == pid)
+			return true;
+	return false;
+}
+
+static int it930x_pid_find(struct state *state, u16 pid)
+{
+	int i;
+
+	for (i = 0; i < IT930X_PID_SLOTS; i++)
+		if ((state->pid_slots & BIT_ULL(i)) && state->pid_slot[i] == pid)
+			return i;
+	return -1;
+}
+
+/* queue the writes that (un)load one hardware entry */
+static void it930x_pid_slot_wr(struct dvb_usb_device *d, int slot, u16 pid,
+		bool on, struct it930x_ctrl_batch *b)
+{
+	u8 data[2] = { pid & 0xff, (pid >> 8) & 0xff };
+	u8 tmp;
+
+	it930x_wr_regs_batch(d, IT930X_PID_VALUE, data, 2, b);
+	tmp = on;
+	it930x_wr_regs_batch(d, IT930X_PID_ENABLE, &tmp, 1, b);
+	tmp = slot;
+	it930x_wr_regs_batch(d, IT930X_PID_INDEX, &tmp, 1, b);
+}
+
+/*
+ * Give every running feed a hardware entry and pick the remap mode. The
+ * full TS (pid 0x2000), a feed that finds the table full, and pid_filter=0
+ * all leave the bridge passing everything; it goes back to filtering once
+ * the feeds fit again.
+ */
+static void it930x_pid_update(struct dvb_usb_device *d,
+		struct it930x_ctrl_batch *b)
+{
+	struct state *state = d_to_priv(d);
+	bool pass = !state->pid_on || !pid_filter;
+	u16 pid;
+	int i, slot;
+	u8 mode;
+
+	for (i = 0; i < IT930X_PID_FEEDS; i++) {
+		if (!test_bit(i, state->feed_on))
+			continue;
+		pid = state->feed_pid[i];
+		if (pid >= 0x2000) {
+			pass = true;
+			continue;
+		}
+		if (it930x_pid_find(state, pid) >= 0)
+			continue;
+		if (state->pid_slots == ~0ULL) {
+			pass = true;
+			continue;
+		}
+		slot = __ffs64(~state->pid_slots);
+		state->pid_slots |= BIT_ULL(slot);
+		state->pid_slot[slot] = pid;
+		it930x_pid_slot_wr(d, slot, pid, true, b);
+	}
+
+	if (pass == state->pid_pass && !state->pid_resync)
+		return;
+
+	state->pid_resync = false;
+	dev_dbg(&d->udev->dev, "pid filter %s\n", pass ? "off" : "on");
+	state->pid_pass = pass;
+	mode = pass ? 0 : 2;
+	it930x_wr_regs_batch(d, IT930X_PID_REMAP_MODE, &mode, 1, b);
+}
+
+/* after a failed write reload the table from scratch on the next change */
+static int it930x_pid_wait(struct dvb_usb_device *d,
+		struct it930x_ctrl_batch *b)
+{
+	struct state *state = d_to_priv(d);
+	int ret;
+
+	ret = it930x_ctrl_batch_wait(d, b);
+	if (ret) {
+		state->pid_slots = 0;
+		state->pid_resync = true;
+	}
+	return ret;
+}
+
 static int it930x_pid_filter_ctrl(struct dvb_usb_adapter *adap, int onoff)
 {
 	struct dvb_usb_device *d = adap_to_d(adap);
-	u32 remap_mode_regs[5] = {
-		0xda13,
-		0xda25,
-		0xda29,
-		0xda2d,
-		0xda7f
-	};
-	int ret = 0;
+	struct state *state = d_to_priv(d);
+	struct it930x_ctrl_batch b;
 	u8 port, data[2];
 
 	port = 0;
+	it930x_ctrl_batch_init(&b);
 
-	/* block or pass */
-	ret = it930x_wr_reg(d, remap_mode_regs[port], onoff ? 2 : 0);
-	if (ret)
-		return ret;
+	state->pid_on = onoff;
+	state->pid_resync = true;
+	it930x_pid_update(d, &b);
 
 	/* sync_byte and remap */
-	ret = it930x_wr_reg(d, 0xda73 + port, 3);
-	if (ret)
-		return ret;
+	data[0] = 3;
+	it930x_wr_regs_batch(d, 0xda73 + port, data, 1, &b);
 
 	data[0] = 0;
 	data[1] = 0;
 
 	/* pid offset */
-	ret = it930x_wr_regs(d, 0xda81 + (port * 2), data, 2);
-	if (ret)
-		return ret;
+	it930x_wr_regs_batch(d, 0xda81 + (port * 2), data, 2, &b);
 
-//	dev_info(&d->udev->dev, "it930x_pid_filter_ctrl onoff=%d\n", onoff);
-	return 0;
+	return it930x_pid_wait(d, &b);
 }
 
 static int it930x_pid_filter(struct dvb_usb_adapter *adap, int index, u16 pid,
 		int onoff)
 {
 	struct dvb_usb_device *d = adap_to_d(adap);
-	u32 pid_index_regs[5] = {
-		0xda15,
-		0xda26,
-		0xda2a,
-		0xda2e,
-		0xda80
-	};
-	int ret = 0;
-	u8 port, data[2];
+	struct state *state = d_to_priv(d);
+	struct it930x_ctrl_batch b;
+	int slot;
 
-	port = 0;
-	data[0] = pid & 0xff;
-	data[1] = (pid >> 8) & 0xff;
+	if (index < 0 || index >= IT930X_PID_FEEDS)
+		return -EINVAL;
 
-	/* target pid */
-	ret = it930x_wr_regs(d, 0xda16, data, 2);
-	if (ret)
-		return ret;
+	dev_dbg(&d->udev->dev, "index=%d pid=%04x onoff=%d\n", index, pid, onoff);
+	it930x_ctrl_batch_init(&b);
 
-	/* enable */
-	ret = it930x_wr_reg(d, 0xda14, 1);
-	if (ret)
-		return ret;
+	if (onoff) {
+		state->feed_pid[index] = pid;
+		set_bit(index, state->feed_on);
+	} else {
+		clear_bit(index, state->feed_on);
+		/* free the entry unless another feed shares the pid */
+		slot = it930x_pid_find(state, pid);
+		if (slot >= 0 && !it930x_pid_is_on(state, pid)) {
+			state->pid_slots &= ~BIT_ULL(slot);
+			it930x_pid_slot_wr(d, slot, pid, false, &b);
+		}
+	}
+	it930x_pid_update(d, &b);
 
-	/* index */
-	ret = it930x_wr_reg(d, pid_index_regs[port], index);
-	if (ret)
-		return ret;
-	
-//	dev_info(&d->udev->dev, "it930x_pid_filter index=%d pid=%u onoff=%d\n", index, pid, onoff);
-	return 0;
+	return it930x_pid_wait(d, &b);
 }
 
 static const struct dvb_usb_device_properties it930x_props = {
@@ -1112,18 +1900,19 @@ static const struct dvb_usb_device_properties it930x_props = {
 	.frontend_attach = it930x_frontend_attach,
 	.tuner_attach = it930x_tuner_attach,
 	.init = it930x_init,
+	.exit = it930x_exit,
 	.get_stream_config = it930x_get_stream_config,
 
 	.num_adapters = 1,
 	.adapter = {
 		{
-			.caps = DVB_USB_ADAP_HAS_PID_FILTER,
-//			.caps = DVB_USB_ADAP_HAS_PID_FILTER |
-//				DVB_USB_ADAP_PID_FILTER_CAN_BE_TURNED_OFF |
-//				DVB_USB_ADAP_NEED_PID_FILTERING ,
-			.pid_filter_count = 64,
-//			.pid_filter_ctrl = it930x_pid_filter_ctrl,
-//			.pid_filter = it930x_pid_filter,
+			.caps = DVB_USB_ADAP_HAS_PID_FILTER |
+				DVB_USB_ADAP_PID_FILTER_CAN_BE_TURNED_OFF |
+				DVB_USB_ADAP_NEED_PID_FILTERING,
+			/* feeds, not entries: it930x_pid_update falls back */
+			.pid_filter_count = IT930X_PID_FEEDS,
+			.pid_filter_ctrl = it930x_pid_filter_ctrl,
+			.pid_filter = it930x_pid_filter,
 			
 			.stream = DVB_USB_STREAM_BULK(0x84, 4, 816 * 188),
 //		}, {
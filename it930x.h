@@ -9,6 +9,7 @@
 #define IT930X_H
 
 #include <linux/platform_device.h>
+#include <linux/semaphore.h>
 #include <dvb_usb.h>
 #include "avl6381.h"
 #include "mxl603_tuner.h"
@@ -22,6 +23,7 @@ struct reg_val_mask {
 	u32 reg;
 	u8  val;
 	u8  mask;
+	u8  delay_ms;	/* sleep after the write, see it930x_wr_reg_table */
 };
 
 struct usb_req {
@@ -31,11 +33,85 @@ struct usb_req {
 	u8  *wbuf;
 	u8  rlen;
 	u8  *rbuf;
+	u8  dlen;	/* optional payload sent right after wbuf */
+	u8  *dbuf;
+};
+
+/* control messages that may be on the bus at once */
+#define IT930X_CTRL_DEPTH 4
+
+/* called from URB completion, i.e. in atomic context */
+typedef void (*it930x_ctrl_cb)(void *priv, int ret);
+
+struct it930x_ctrl;
+
+/* one control message in flight */
+struct it930x_ctrl_slot {
+	struct dvb_usb_device *d;
+	struct it930x_ctrl *ctrl;
+	struct urb *tx_urb;
+	u8 *tx_buf;
+	struct list_head node;	/* on ctrl->fifo while the reply is due */
+	u8 cmd;
+	u8 seq;
+	u8 wlen;	/* payload sizes, for the trace */
+	u8 rlen;
+	u8 *rbuf;	/* reply payload goes here */
+	int status;	/* first error */
+	unsigned int wait;	/* IT930X_WAIT_* still outstanding */
+	ktime_t start;
+	it930x_ctrl_cb cb;
+	void *cb_priv;
+};
+
+/*
+ * The control channel. Allocated on first use as a resource of the USB
+ * interface, so it goes away on unbind and on a failed probe alike.
+ */
+struct it930x_ctrl {
+	struct dvb_usb_device *d;
+	struct it930x_ctrl_slot slot[IT930X_CTRL_DEPTH];
+	unsigned long busy;	/* bit per slot */
+	struct semaphore sem;	/* counts free slots */
+	struct usb_anchor anchor;	/* every control URB in flight */
+	spinlock_t lock;	/* fifo, reader and slot wait/status */
+	struct list_head fifo;	/* slots waiting for a reply, oldest first */
+	struct urb *rd_urb;	/* the single reply reader */
+	u8 *rd_buf;
+	bool rd_busy;
+	u32 stale;		/* replies nobody was waiting for */
+};
+
+/* bridge registers programmed by it930x_wr_reg_table */
+#define IT930X_REGCACHE_SIZE 32
+
+struct it930x_regcache {
+	u32 reg;
+	u8  val;
+};
+
+/* gpioh1..16 input/output/mode/enable registers, 0xd8ae..0xd8ed */
+#define IT930X_GPIO_BASE 0xd8ae
+#define IT930X_GPIO_WIN 64
+
+/*
+ * PID filter: 64 hardware entries, but the demux may run up to
+ * IT930X_PID_FEEDS feeds; past the table the bridge passes the full TS.
+ */
+#define IT930X_PID_SLOTS 64
+#define IT930X_PID_FEEDS 255
+
+/* bring-up steps timed for the cold boot log */
+enum it930x_boot_step {
+	IT930X_BOOT_IDENTIFY,
+	IT930X_BOOT_FIRMWARE,
+	IT930X_BOOT_DEMOD_RESET,
+	IT930X_BOOT_INIT,
+	IT930X_BOOT_NR,
 };
 
 struct state {
 #define BUF_LEN 255
-	u8 buf[BUF_LEN];
 	u8 seq; /* packet sequence number */
 	u8 prechip_version;
 	u8 chip_version;
@@ -45,6 +121,31 @@ struct state {
 	u8 ir_mode;
 	u8 ir_type;
 	u8 dual_mode:1;
+	s64 boot_us[IT930X_BOOT_NR];
+	u32 ctrl_msgs;	/* round trips since probe */
+	spinlock_t regcache_lock;
+	struct it930x_regcache regcache[IT930X_REGCACHE_SIZE];
+	int regcache_n;
+	int regcache_next;	/* slot replaced when full */
+	bool inited;		/* init ran, a later one is a reset-resume */
+	u8 gpio_shadow[IT930X_GPIO_WIN];	/* last value written */
+	u64 gpio_valid;		/* shadow bytes known to match the bridge */
+	u64 gpio_dirty;		/* changed, not written yet */
+	bool gpio_defer;	/* hold writes until it930x_gpio_flush */
+	u16 feed_pid[IT930X_PID_FEEDS];	/* by demux feed index */
+	DECLARE_BITMAP(feed_on, IT930X_PID_FEEDS);
+	u16 pid_slot[IT930X_PID_SLOTS];	/* pid in each hardware entry */
+	u64 pid_slots;		/* hardware entries in use */
+	bool pid_on;		/* between pid_filter_ctrl on and off */
+	bool pid_pass;		/* bridge passes the full TS */
+	bool pid_resync;	/* bridge state unknown, write the mode */
+
+	struct it930x_ctrl *ctrl;
+	bool ctrl_dead;		/* .exit ran, no more control messages */
+
+	/* per-device copies, the drivers keep pointers to them */
+	struct avl6381_config avl6381cfg;
+	struct mxl603_config mxl603cfg;
 };
 
 /* USB commands */
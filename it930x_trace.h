@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * ITE IT930x driver tracepoints
+ *
+ * Copyright (C) 2024 Xiaodong Ni <nxiaodong520@gmail.com>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM it930x
+
+#if !defined(_IT930X_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IT930X_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* one control message round trip, ret as returned by it930x_ctrl_msg */
+TRACE_EVENT(it930x_ctrl_msg,
+	TP_PROTO(int devnum, u8 cmd, u8 seq, int wlen, int rlen, s64 us, int ret),
+	TP_ARGS(devnum, cmd, seq, wlen, rlen, us, ret),
+
+	TP_STRUCT__entry(
+		__field(int, devnum)
+		__field(u8, cmd)
+		__field(u8, seq)
+		__field(int, wlen)
+		__field(int, rlen)
+		__field(s64, us)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->devnum = devnum;
+		__entry->cmd = cmd;
+		__entry->seq = seq;
+		__entry->wlen = wlen;
+		__entry->rlen = rlen;
+		__entry->us = us;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d cmd=%02x seq=%u wlen=%d rlen=%d %lld us ret=%d",
+		__entry->devnum, __entry->cmd, __entry->seq,
+		__entry->wlen, __entry->rlen, __entry->us, __entry->ret)
+);
+
+#endif /* _IT930X_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE it930x_trace
+#include <trace/define_trace.h>
@@ -12,11 +12,12 @@
 #include "mxl603_tuner.h"
 
 struct mxl603_state {
-	struct mxl603_config *config;
+	struct mxl603_config config;	/* own copy, set_params changes it */
 	struct i2c_adapter   *i2c;
 	u8 addr;
 	u32 frequency;
 	u32 bandwidth;
+	int probed;	/* chip found, done on the first init */
 };
 
 static int mxl603_synth_lock_status(struct mxl603_state *state, int *rf_locked, int *ref_locked)
@@ -49,6 +50,7 @@ static int mxl603_get_status(struct dvb_frontend *fe, u32 *status)
 {
 	struct mxl603_state *state = fe->tuner_priv;
 	int rf_locked, ref_locked, ret;
+	MXL_BOOL agc_locked;
 
 	*status = 0;
 
@@ -59,10 +61,16 @@ static int mxl603_get_status(struct dvb_frontend *fe, u32 *status)
 	if (ret)
 		goto err;
 
-	dev_info(&state->i2c->dev, "%s%s", rf_locked ? "rf locked " : "",
-			ref_locked ? "ref locked" : "");
+	/* locked means the synthesizer is and the AGC has settled on a signal */
+	ret = MxLWare603_API_ReqTunerAGCLock(state->i2c, state->addr, &agc_locked);
+	if (ret)
+		goto err;
+
+	dev_dbg(&state->i2c->dev, "%s%s%s", rf_locked ? "rf locked " : "",
+			ref_locked ? "ref locked " : "",
+			agc_locked == MXL_LOCKED ? "agc locked" : "");
 
-	if ((rf_locked) || (ref_locked))
+	if ((rf_locked || ref_locked) && agc_locked == MXL_LOCKED)
 		*status |= TUNER_STATUS_LOCKED;
 
 		
@@ -125,16 +133,16 @@ static int mxl603_set_params(struct dvb_frontend *fe)
 
 	switch (c->delivery_system) {
 	case SYS_ATSC:
-		state->config->tunerModeCfg.signalMode = MXL603_DIG_ISDBT_ATSC;
+		state->config.tunerModeCfg.signalMode = MXL603_DIG_ISDBT_ATSC;
 		bandWidth = MXL603_TERR_BW_6MHz ;
 		break;
 	case SYS_DVBC_ANNEX_A:
-		state->config->tunerModeCfg.signalMode = MXL603_DIG_DVB_C;
+		state->config.tunerModeCfg.signalMode = MXL603_DIG_DVB_C;
 		bandWidth = MXL603_CABLE_BW_8MHz;	
 		break;
 	case SYS_DVBT:
 	case SYS_DVBT2:
-		state->config->tunerModeCfg.signalMode = MXL603_DIG_DVB_T_DTMB;
+		state->config.tunerModeCfg.signalMode = MXL603_DIG_DVB_T_DTMB;
 		switch (c->bandwidth_hz) {
 		case 6000000:
 			bandWidth = MXL603_TERR_BW_6MHz;
@@ -163,7 +171,7 @@ static int mxl603_set_params(struct dvb_frontend *fe)
 	ifOutCfg.gainLevel = 11;
 	ifOutCfg.manualFreqSet = MXL_DISABLE;
 	ifOutCfg.manualIFOutFreqInKHz = 5000;//4984;*/
-	ret = MxLWare603_API_CfgTunerIFOutParam(state->i2c, state->addr, state->config->ifOutCfg);
+	ret = MxLWare603_API_CfgTunerIFOutParam(state->i2c, state->addr, state->config.ifOutCfg);
 	if (ret)
 		goto err;
 
@@ -174,11 +182,11 @@ static int mxl603_set_params(struct dvb_frontend *fe)
 //	tunerModeCfg.xtalFreqSel = MXL603_XTAL_24MHz;
 //	tunerModeCfg.ifOutGainLevel = 11;
 
-	ret = MxLWare603_API_CfgTunerMode(state->i2c, state->addr, state->config->tunerModeCfg);
+	ret = MxLWare603_API_CfgTunerMode(state->i2c, state->addr, state->config.tunerModeCfg);
 	if (ret)
 		goto err;
 
-	Mxl603SetFreqBw(state->i2c, state->addr, freq, bandWidth, state->config->tunerModeCfg.signalMode);
+	Mxl603SetFreqBw(state->i2c, state->addr, freq, bandWidth, state->config.tunerModeCfg.signalMode);
 	if (ret)
 		goto err;
 
@@ -212,16 +220,45 @@ static int mxl603_get_bandwidth(struct dvb_frontend *fe, u32 *bandwidth)
 	return 0;
 }
 
+/*
+ * Reset the chip and check it answers. Not done at attach: the demod is
+ * still loading its patch then and the tuner sits behind its I2C gate.
+ * Called with the gate open.
+ */
+static int mxl603_probe(struct mxl603_state *state)
+{
+	MXL603_VER_INFO_T	mxl603Version;
+	int ret;
+
+	ret = MxLWare603_API_CfgDevSoftReset(state->i2c, state->addr);
+
+	ret |= MxLWare603_API_ReqDevVersionInfo(state->i2c, state->addr, &mxl603Version);
+
+	if (ret) {
+		dev_err(&state->i2c->dev, "MXL603 not found\n");
+		return -ENODEV;
+	}
+
+	dev_info(&state->i2c->dev, "MXL603 detected id(%02x) ver(%02x)\n", mxl603Version.chipId, mxl603Version.chipVersion);
+	state->probed = 1;
+	return 0;
+}
+
 static int mxl603_tuner_init(struct dvb_frontend *fe)
 {
 	struct mxl603_state *state = fe->tuner_priv;
 	int ret;
-	MXL603_VER_INFO_T	mxl603Version;
 
 	if (fe->ops.i2c_gate_ctrl)
 		fe->ops.i2c_gate_ctrl(fe, 1);
 
-	ret = MXL603_init(state->i2c, state->addr, *state->config);
+	if (!state->probed) {
+		ret = mxl603_probe(state);
+		if (ret)
+			goto err;
+	}
+
+	ret = MXL603_init(state->i2c, state->addr, state->config);
 
 	if (fe->ops.i2c_gate_ctrl)
 		fe->ops.i2c_gate_ctrl(fe, 0);
@@ -289,7 +326,7 @@ static struct dvb_tuner_ops mxl603_tuner_ops = {
 	.init              = mxl603_tuner_init,
 	.sleep             = mxl603_sleep,
 	.set_params        = mxl603_set_params,
-//	.get_status        = mxl603_get_status,
+	.get_status        = mxl603_get_status,
 	.get_rf_strength   = mxl603_get_rf_strength,
 //	.get_frequency     = mxl603_get_frequency,
 //	.get_bandwidth     = mxl603_get_bandwidth,
@@ -302,36 +339,22 @@ struct dvb_frontend *mxl603_attach(struct dvb_frontend *fe,
 				     struct mxl603_config *config)
 {
 	struct mxl603_state *state = NULL;
-	int ret = 0;
-	MXL603_VER_INFO_T	mxl603Version;
 
 	state = kzalloc(sizeof(struct mxl603_state), GFP_KERNEL);
 	if (!state) {
-		ret = -ENOMEM;
 		dev_err(&i2c->dev, "kzalloc() failed\n");
 		goto err1;
 	}
 	
-	state->config = config;
+	state->config = *config;
 	state->i2c = i2c;
 	state->addr = addr;
 	
-	if (fe->ops.i2c_gate_ctrl)
-		fe->ops.i2c_gate_ctrl(fe, 1);
-		
-	ret = MxLWare603_API_CfgDevSoftReset(state->i2c, state->addr);
-
-	ret |= MxLWare603_API_ReqDevVersionInfo(state->i2c, state->addr, &mxl603Version);
-
-	if (fe->ops.i2c_gate_ctrl)
-		fe->ops.i2c_gate_ctrl(fe, 0);
-
-	dev_info(&state->i2c->dev, "MXL603 detected id(%02x) ver(%02x)\n", mxl603Version.chipId, mxl603Version.chipVersion);
-
-	/* check return value of mxl603_get_chip_id */
-	if (ret)
-		goto err2;
-	
+	/*
+	 * The chip is not probed here: the demod's I2C gate is busy with the
+	 * patch upload. mxl603_probe() runs on the first init, which the
+	 * avl6381 does once the upload is done.
+	 */
 	dev_info(&i2c->dev, "Attaching MXL603\n");
 	
 	fe->tuner_priv = state;
@@ -341,8 +364,6 @@ struct dvb_frontend *mxl603_attach(struct dvb_frontend *fe,
 
 	return fe;
 	
-err2:
-	kfree(state);
 err1:
 	return NULL;
 }